@@ -166,6 +166,219 @@ close FOO;
       ') 2>/dev/null',
       "aX"
     ],
+
+# phase-fair lock policy
+    # 18
+    [ # A reader that arrives while a writer holds the lock is admitted as
+      # soon as that writer finishes, ahead of a writer queued before it.
+      './osprdaccess -r 0 -P phasefair ; ' .
+      '(echo a | ./osprdaccess -w 1 -l -d 0.5) & ' .
+      'sleep 0.1 ; (echo b | ./osprdaccess -w 1 -l) & ' .
+      'sleep 0.2 ; ./osprdaccess -r 1 -l ; ' .
+      'sleep 0.2 ; ./osprdaccess -r 0 -P fifo',
+      "a"
+    ],
+
+# timed lock acquisition
+    # 19
+    [ '(echo a | ./osprdaccess -w 1 -l -d 0.5) & ' .
+      'sleep 0.1 ; ./osprdaccess -r 1 -l -t 0.1 ; ' .
+      './osprdaccess -r 1 -l -t 1',
+      "ioctl OSPRDIOCTIMEDACQUIRE: Connection timed out a"
+    ],
+
+# user-space fast-path locks
+    # 20
+    [ # A fast-path writer excludes both fast-path and ioctl readers.
+      '(echo a | ./osprdaccess -w 1 -l -f -d 0.5) & ' .
+      'sleep 0.1 ; ./osprdaccess -r 1 -L -f ; ' .
+      './osprdaccess -r 1 -l -f ; ./osprdaccess -r 1 -l',
+      "fast lock: Device or resource busy aa"
+    ],
+
+# asynchronous lock requests
+    # 21
+    [ '(echo a | ./osprdaccess -w 1 -l -d 0.5) & ' .
+      'sleep 0.1 ; ./osprdaccess -r 1 -l -a',
+      "a"
+    ],
+
+# changed-sector tracking
+    # 22
+    [ 'g=`./osprdaccess -c 0 | head -n 1` ; ' .
+      'echo x | ./osprdaccess -w 1 -o 1024 ; ' .
+      'echo y | ./osprdaccess -w 1 -o 5000 ; ' .
+      './osprdaccess -c $g | tail -n +2 | grep -x -e 2 -e 9',
+      "2 9"
+    ],
+
+# mirroring
+    # 23
+    [ './osprdaccess -m b ; ' .
+      'echo mirrored | ./osprdaccess -w 9 ; ' .
+      'sleep 0.2 ; ./osprdaccess -s | head -n 2 ; ' .
+      './osprdaccess -r 9 /dev/osprdb ; ' .
+      './osprdaccess -m none',
+      "mirror: b lag: 0 mirrored"
+    ],
+
+# zero-copy transfers
+    # 24
+    [ 'echo zerocopy | ./osprdaccess -w -Z ; ' .
+      './osprdaccess -r 9 -Z',
+      "zerocopy"
+    ],
+
+# scripted mode
+    # 25
+    [ 'printf "open /dev/osprda w\\nlock\\nwrite scripted\\nrelease\\n' .
+      'close\\nopen /dev/osprda\\nbogus\\ntrylock\\nread 8\\n" | ' .
+      './osprdaccess -x - 2>&1',
+      "line 7: bogus: Invalid argument scripted"
+    ],
+
+# lock classes
+    # 26
+    [ '(echo a | ./osprdaccess -w 1 -l -d 0.5) & sleep 0.1 ; ' .
+      '(echo b | ./osprdaccess -w 1 -l -p low -d 0.2 ; echo L) & sleep 0.1 ; ' .
+      '(echo c | ./osprdaccess -w 1 -l -p high -d 0.2 ; echo H) & sleep 1.2',
+      "H L"
+    ],
+
+# snapshot reads
+    # 27
+    [ 'echo old | ./osprdaccess -w 3 ; ' .
+      '(./osprdaccess -r 3 -S -d 0.4 ; echo) & sleep 0.1 ; ' .
+      'echo new | ./osprdaccess -w 3 -l ; echo wrote ; ' .
+      'sleep 0.5 ; ./osprdaccess -r 3',
+      "wrote old new"
+    ],
+
+# trace and replay
+    # 28
+    [ 'echo 1 > /sys/module/osprd/parameters/trace ; ' .
+      './osprdaccess -r 0 -l -d 0.5 ; ' .
+      'echo 0 > /sys/module/osprd/parameters/trace ; ' .
+      'cat /proc/osprdtrace > /tmp/osprd.trace ; ' .
+      '(./osprdreplay /tmp/osprd.trace &) ; sleep 0.2 ; ' .
+      'echo x | ./osprdaccess -w 1 -L 2>&1 ; sleep 0.5',
+      "ioctl OSPRDIOCTRYACQUIRE: Device or resource busy"
+    ],
+
+# write-back writes
+    # 29
+    [ 'echo writeback | ./osprdaccess -w 9 -W -b 2 ; ' .
+      './osprdaccess -r 9',
+      "writeback"
+    ],
+
+# direct I/O
+    # 30
+    [ 'head -c 8192 /dev/zero | tr "\\0" d | ' .
+      './osprdaccess -w 8192 -D -b 8192 ; ' .
+      './osprdaccess -r 6 -o 8186',
+      "dddddd"
+    ],
+
+# throttling
+    # 31
+    [ './osprdaccess -q 0 5 ; ' .
+      'echo throttle | ./osprdaccess -w 8 -b 1 ; ' .
+      './osprdaccess -q 0 0 ; ' .
+      './osprdaccess -s | grep -c "^throttled: [1-9]" ; ' .
+      './osprdaccess -r 8',
+      "1 throttle"
+    ],
+
+# CPU pinning
+    # 32
+    [ 'echo pinned | ./osprdaccess -w 6 -C 0 ; ' .
+      './osprdaccess -r 6 -C 0',
+      "pinned"
+    ],
+
+# non-temporal copy of a large write
+    # 33
+    [ 'head -c 262144 /dev/zero | tr "\\0" n | ' .
+      './osprdaccess -w 262144 -D -b 262144 ; ' .
+      './osprdaccess -r 262144 | tr -d n | wc -c ; ' .
+      './osprdaccess -r 4 -o 262140',
+      "0 nnnn"
+    ],
+
+# scrubbing needs checksums, which are off by default
+    # 34
+    [ './osprdaccess -k',
+      "ioctl OSPRDIOCSCRUB: Invalid argument"
+    ],
+
+# inline completion of small direct I/O
+    # 35
+    [ 'echo 4 > /sys/module/osprd/parameters/inline_kb ; ' .
+      'head -c 4096 /dev/zero | tr "\\0" i | ' .
+      './osprdaccess -w 4096 -D -b 4096 ; ' .
+      './osprdaccess -r 4096 -D -b 4096 | tr -d i | wc -c ; ' .
+      'echo 0 > /sys/module/osprd/parameters/inline_kb ; ' .
+      './osprdaccess -r 6 -o 4090',
+      "0 iiiiii"
+    ],
+
+# multi-device locks, released when the holder exits
+    # 36
+    [ '(printf "open /dev/osprda w\\nopen /dev/osprdb w\\nlockall ab ab\\n' .
+      'sleep 0.4\\n" | ./osprdaccess -x -) & sleep 0.1 ; ' .
+      'echo x | ./osprdaccess -w 1 -L /dev/osprda ; ' .
+      'echo x | ./osprdaccess -w 1 -L /dev/osprdb ; sleep 0.5 ; ' .
+      'echo y | ./osprdaccess -w 1 -L /dev/osprda ; ' .
+      'echo y | ./osprdaccess -w 1 -L /dev/osprdb ; ' .
+      './osprdaccess -r 1 /dev/osprdb ; ' .
+      'printf "open /dev/osprda\\nlockall ab\\n" | ./osprdaccess -x - 2>&1',
+      "ioctl OSPRDIOCTRYACQUIRE: Device or resource busy " .
+      "ioctl OSPRDIOCTRYACQUIRE: Device or resource busy " .
+      "y line 2: lockall: Bad file descriptor"
+    ],
+
+# fast-path locks are dropped when their holder dies
+    # 37
+    [ '(set -m; ' .
+      '(echo b | ./osprdaccess -w 1 -l -f -d 5) & bgshell1=$! ; ' .
+      'sleep 0.2 ; kill -9 -$bgshell1 ; sleep 0.1 ; ' .
+      'echo c | ./osprdaccess -w 1 -L ; ./osprdaccess -r 1 -L ' .
+      ') 2>/dev/null',
+      "c"
+    ],
+
+# lock upgrades and downgrades
+    # 38
+    [ # A sole reader's upgrade shuts out other readers.
+      '(printf "open /dev/osprda\\nlock\\nupgrade\\nsleep 0.4\\n" | ' .
+      './osprdaccess -x -) & sleep 0.2 ; ' .
+      './osprdaccess -r 1 -L ; sleep 0.4 ; ' .
+      'echo u | ./osprdaccess -w 1 -L ; ./osprdaccess -r 1 -L',
+      "ioctl OSPRDIOCTRYACQUIRE: Device or resource busy u"
+    ],
+
+    # 39
+    [ # A second upgrader fails rather than deadlock; the first waits
+      # until the other reader is gone.
+      'echo d | ./osprdaccess -w 1 ; ' .
+      '(printf "open /dev/osprda\\nlock\\nsleep 0.1\\nupgrade\\nread 1\\n" | ' .
+      './osprdaccess -x -) & sleep 0.05 ; ' .
+      'printf "open /dev/osprda\\nlock\\nsleep 0.2\\nupgrade\\nsleep 0.2\\n" | ' .
+      './osprdaccess -x - 2>&1 ; wait',
+      "line 4: upgrade: Resource deadlock avoided d"
+    ],
+
+    # 40
+    [ # A writer's downgrade lets the queued reader in while it still
+      # reads, ahead of the reader's timeout.
+      'echo d | ./osprdaccess -w 1 ; ' .
+      '(printf "open /dev/osprda w\\nlock\\nwrite e\\nsleep 0.2\\n' .
+      'downgrade\\nsleep 0.4\\n" | ./osprdaccess -x -) & sleep 0.1 ; ' .
+      './osprdaccess -r 1 -l -t 0.3 ; ' .
+      'echo f | ./osprdaccess -w 1 -L ; wait',
+      "e ioctl OSPRDIOCTRYACQUIRE: Device or resource busy"
+    ],
     );
 
 my($ntest) = 0;
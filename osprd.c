@@ -13,13 +13,35 @@
 #include <linux/blkdev.h>
 #include <linux/wait.h>
 #include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/delay.h>	/* udelay() */
+#include <linux/proc_fs.h>
+#include <linux/crc32c.h>
+#include <linux/sort.h>
+#include <asm/uaccess.h>	/* copy_from_user(), copy_to_user() */
+#include <asm/io.h>		/* virt_to_phys() */
+#include <asm/system.h>		/* cmpxchg() */
+#include <asm/div64.h>		/* do_div() */
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>	/* cpu_has_xmm2 */
+#endif
 
 #include "spinlock.h"
 #include "osprd.h"
 
-/* The size of an OSPRD sector. */
+/* The size of an OSPRD sector.  The block layer always addresses disks in
+ * units of 512 bytes, even if their logical block size is larger. */
 #define SECTOR_SIZE	512
 
+/* Request limits.  Requests are just copies to or from memory, so large
+ * I/Os are best passed down whole rather than split. */
+#define OSPRD_MAX_SECTORS	2048	// 1 MB per request
+#define OSPRD_MAX_SEGMENTS	256
+
 /* This flag is added to an OSPRD file's f_flags to indicate that the file
  * is locked. */
 #define F_OSPRD_LOCKED	0x80000
@@ -44,6 +66,53 @@ MODULE_AUTHOR("Gloria Chan & Victor Lai");
 static int nsectors = 32;
 module_param(nsectors, int, 0);
 
+/* This module parameter selects the initial lock policy of every device:
+ * OSPRD_POLICY_FIFO (0) or OSPRD_POLICY_PHASEFAIR (1).  A device's policy
+ * can be changed later with the OSPRDIOCSETPOLICY ioctl. */
+static int lock_policy = OSPRD_POLICY_FIFO;
+module_param(lock_policy, int, 0);
+
+/* This module parameter is the longest time, in microseconds, that a
+ * process waiting for a lock spins before going to sleep.  It can be
+ * changed at any time through /sys/module/osprd/parameters/spin_usecs;
+ * 0 turns spinning off. */
+static int spin_usecs = 20;
+module_param(spin_usecs, int, 0644);
+
+/* This module parameter bounds starvation between lock classes: for every
+ * prio_aging_ms milliseconds a request waits, it is served as if its class
+ * were one higher.  0 means strict priority. */
+static int prio_aging_ms = 100;
+module_param(prio_aging_ms, int, 0644);
+
+/* While 'trace' is set, requests and ioctls are recorded in a buffer of
+ * trace_size events per CPU, drained by reading /proc/osprdtrace. */
+static int trace = 0;
+module_param(trace, int, 0644);
+static int trace_size = 4096;
+module_param(trace_size, int, 0);
+
+/* Writes of at least nt_copy_kb kilobytes are stored into the disk with
+ * non-temporal stores, which bypass the CPU caches: data loaded into a
+ * ramdisk in bulk is seldom read back soon, and caching it would evict
+ * everyone else's working set.  0 turns this off. */
+static int nt_copy_kb = 64;
+module_param(nt_copy_kb, int, 0644);
+
+/* Requests of at least parallel_copy_kb kilobytes are copied by all CPUs
+ * at once rather than by the one running the request function.  0 turns
+ * this off. */
+static int parallel_copy_kb = 256;
+module_param(parallel_copy_kb, int, 0644);
+
+/* I/Os of at most inline_kb kilobytes are copied as soon as they are
+ * submitted, by the submitting process, instead of going through the
+ * request queue: no request is allocated, merged or waited for.  This
+ * cuts the latency of small direct I/O.  0, the default, turns this off,
+ * so that small writes can merge in the queue. */
+static int inline_kb = 0;
+module_param(inline_kb, int, 0644);
+
 struct process {
 	struct task_struct* info;
 	int reqNotif;    // Tells if the process requested a notification. 
@@ -66,19 +135,106 @@ struct pidList {
 
 struct ticketNode {
 	unsigned ticket;
+	int cls;			// OSPRD_CLASS_* of the request
+	unsigned long since;		// jiffies when the ticket was taken
+	unsigned long long start;	// The same, in microseconds
 	struct ticketNode* next;
 };
 
 struct ticketList {
 	struct ticketNode* head;
+	struct ticketNode* tail;
 	unsigned size;
 };
 
+/* A change ring set up with OSPRDIOCRING. */
+struct ringSub {
+	struct file* filp;		// File the ring was set up on
+	struct osprd_ring* ring;	// vmalloc_user()ed so it can be mapped
+	struct ringSub* next;
+};
+
+/* A lock request queued with OSPRDIOCENQUEUE that hasn't been granted yet. */
+struct asyncReq {
+	struct file* filp;		// File the request was made on
+	struct task_struct* task;	// Process the lock is granted to
+	int writer;			// 1: write lock, 0: read lock
+	unsigned ticket;		// Ticket, if the request took one
+	unsigned phase;			// Phase-fair readers: write phase
+					// the reader blocked in
+	int admitted;			// Phase-fair readers: 1 once the
+					// write phase has ended
+	struct asyncReq* next;
+};
+
+struct snapBlock;
+
+/* One snapshot's hold on a snapBlock, linked into the snapshot's list. */
+struct snapHold {
+	struct snapBlock* block;
+	struct snapHold* next;
+};
+
+/* Sector contents saved for snapshots by one write, up to
+ * SNAP_BLOCK_SECTORS of them, allocated together. */
+struct snapBlock {
+	atomic_t users;			// Snapshots holding copies in it
+	uint8_t* data;			// The copies
+	struct snapHold holds[0];	// One per snapshot that needed them
+};
+
+#define SNAP_BLOCK_SECTORS	(PAGE_SIZE / SECTOR_SIZE)
+
+/* A snapshot taken with OSPRDIOCSNAPSHOT.  Files that take a snapshot while
+ * nothing has been written since the newest one share it. */
+struct snapshot {
+	unsigned long long generation;	// Device generation it was taken at
+	unsigned refs;			// Files reading it, plus reads in
+					// progress
+	uint8_t** saved;		// For each sector written since the
+					// snapshot, its contents before the
+					// first such write; NULL otherwise
+	struct snapHold* blocks;	// The blocks those copies are in
+	int lost;			// Set if a sector couldn't be saved
+	struct snapshot* next;		// Next older snapshot
+};
+
+/* Throttling state of one process on one device. */
+struct throttleBucket {
+	pid_t tgid;			// Thread group ID of the process
+	int explicit;			// 1 if the limits were set for this
+					// process; 0 if the default applies
+	unsigned bps, iops;		// Explicit limits
+	unsigned long long bytesTat;	// When the process's byte and call
+	unsigned long long iosTat;	// allowances run out, in usecs
+	unsigned long long throttled;	// Calls that had to wait
+	unsigned long long delayUsecs;	// Time they waited
+	struct throttleBucket* next;
+};
+
+/* A file that took a snapshot. */
+struct snapReader {
+	struct file* filp;
+	struct snapshot* snap;
+	struct snapReader* next;
+};
+
 /* The internal representation of our device. */
 typedef struct osprd_info {
 	uint8_t *data;                   // The data array. Its size is
 	                                 // (nsectors * SECTOR_SIZE) bytes.
 
+	unsigned long nsectors;		 // Size of the disk in sectors: the
+					 // nsectors parameter, or the size of
+					 // the backing file in cache mode
+
+	int node;			 // NUMA node 'data' is on, or
+					 // NUMA_ANY or NUMA_INTERLEAVE
+
+	struct page** pages;		 // With NUMA_INTERLEAVE, the pages
+					 // mapped at 'data'
+	unsigned long npages;
+
 	osp_spinlock_t mutex;            // Mutex for synchronizing access to
 					 // this block device
 
@@ -99,12 +255,9 @@ typedef struct osprd_info {
 	struct pidList* writeProcs;      // Maintain a list of processes that 
 					 // hold a write lock
 
-	struct ticketList* exitedTickets;// Maintain a list of tickets that 
-					 // have exited
-
-	int isHoldingOtherLocks;	 // Tells if the device has another 
-					 // lock. If so, there's a deadlock! 
-					 // 1: has another lock, 0: no lock 
+	struct ticketList* waitingTickets[OSPRD_NCLASSES];
+					 // Tickets taken but not yet served
+					 // or given up, oldest first, by class
 
 	struct pidList* notifProcs;	 // Maintain a list of processes that 
 					 // requested a change notification
@@ -112,6 +265,118 @@ typedef struct osprd_info {
 	struct pidList* writeNlkProcs;	 // Maintain a list of processes that 
 					 // want to write with no lock. 
 
+	int lock_policy;		 // OSPRD_POLICY_FIFO or
+					 // OSPRD_POLICY_PHASEFAIR
+
+	/* The following fields are only used by the phase-fair policy. */
+	unsigned write_phase;		 // Incremented whenever a write phase
+					 // ends
+
+	unsigned writersWaiting;	 // Writers that hold a ticket but
+					 // not the lock yet
+
+	unsigned blockedReaders;	 // Readers waiting for the current
+					 // write phase to end
+
+	unsigned admittedReaders;	 // Readers let in by the end of a
+					 // write phase that haven't entered
+
+	pid_t upgrader;			 // Process waiting to upgrade its read
+					 // lock to a write lock, or 0
+
+	unsigned long long spinAcquires; // Queued locks granted while
+					 // spinning
+	unsigned long long sleepAcquires;// Queued locks granted after
+					 // sleeping
+
+	/* Per-class statistics of ticket waits, in microseconds. */
+	unsigned long long classAcquires[OSPRD_NCLASSES];
+	unsigned long long classWait[OSPRD_NCLASSES];
+	unsigned long long classMaxWait[OSPRD_NCLASSES];
+
+	struct osprd_fastlock* fastlock; // Lock state shared with user space;
+					 // it has a page of its own
+	struct file* fastSlots[OSPRD_FAST_SLOTS]; // File given each slot of
+					 // the page, or NULL; slot 0 is never
+					 // given out.  Protected by mutex
+
+	struct asyncReq* asyncReqs;	 // Lock requests waiting to be
+					 // granted without a sleeping process
+
+	unsigned long long generation;	 // Number of writes so far
+	unsigned long long *sectorGen;	 // Generation of each sector's last
+					 // write.  Both are protected by
+					 // qlock, like 'rings'
+
+	struct ringSub* rings;		 // Change rings of subscribers.
+					 // Protected by qlock, since
+					 // osprd_process_request appends
+					 // to them
+
+	/* The following fields are used for mirroring and are protected by
+	 * qlock.  'mirror' also only changes under mirror_config_lock. */
+	struct osprd_info* mirror;	 // Device writes are copied to, or
+					 // NULL
+
+	unsigned long* mirrorDirty;	 // Bitmap of sectors that still need
+					 // copying to the mirror
+
+	unsigned mirrorLag;		 // Number of bits set in mirrorDirty
+
+	unsigned long long mirrorCopied; // Sectors copied to mirrors so far
+
+	int mirrorBusy;			 // Set while mirror_work is copying
+
+	struct work_struct mirrorWork;	 // Copies dirty sectors to the mirror
+
+	struct snapshot* snapshots;	 // Snapshots being read, newest
+					 // first.  Protected by qlock
+
+	struct snapReader* snapReaders;	 // Files that took them.  Protected
+					 // by qlock
+
+	struct list_head bigWrites;	 // Writes being copied by the copy
+					 // workers, without qlock.  Protected
+					 // by qlock
+	wait_queue_head_t bigWriteq;	 // Woken as each of them finishes
+
+	u32* crcs;			 // Checksum of each sector, or NULL.
+					 // Written along with the sector
+
+	/* The following fields are used for throttling and are protected by
+	 * mutex. */
+	unsigned throttleBps;		 // Default limits; 0: unlimited
+	unsigned throttleIops;
+
+	unsigned throttleExplicit;	 // Buckets with limits of their own
+
+	struct throttleBucket* buckets;	 // Throttled processes
+
+	unsigned long long throttled;	 // Totals over all processes
+	unsigned long long throttleUsecs;
+
+	/* The following fields are used in cache mode, where 'data' caches
+	 * the backing file a line at a time.  Line l of the disk can only be
+	 * cached in slot l % (nsectors / CACHE_LINE).  The slots belong to
+	 * cacheThread, which serves all requests and write-backs. */
+	struct file* backing;		 // Backing file, or NULL if the disk
+					 // is not in cache mode
+
+	unsigned long* cacheTag;	 // Line cached in each slot, or
+					 // CACHE_EMPTY
+
+	unsigned long* cacheDirty;	 // Bitmap of slots that differ from
+					 // the backing file
+
+	unsigned cacheDirtyCount;	 // Number of bits set in cacheDirty
+
+	struct list_head cacheReqs;	 // Requests waiting for cacheThread.
+					 // Protected by qlock
+
+	wait_queue_head_t cacheq;	 // Wait queue for cacheThread
+
+	struct task_struct* cacheThread;
+
 	// The following elements are used internally; you don't need
 	// to understand them.
 	struct request_queue *queue;    // The device request queue.
@@ -123,6 +388,83 @@ typedef struct osprd_info {
 #define NOSPRD 4
 static osprd_info_t osprds[NOSPRD];
 
+/* These module parameters place each device's data on NUMA nodes:
+ * "insmod osprd.ko numa=0,interleave" puts all of /dev/osprda's memory on
+ * node 0 and spreads /dev/osprdb's over every online node, a page at a
+ * time.  Large requests to a disk bound to a node are copied by that node's
+ * CPUs.  Other disks take memory wherever vmalloc() finds it. */
+static char *numa[NOSPRD];
+module_param_array(numa, charp, NULL, 0);
+
+#define NUMA_ANY	(-1)		// No placement
+#define NUMA_INTERLEAVE	(-2)		// Pages spread over all nodes
+
+/* This module parameter sets each device's logical block size in bytes,
+ * 512 or 4096: "insmod osprd.ko block_size=4096,512" makes /dev/osprda
+ * 4K-native, so it only sees 4K-aligned I/O.  A 4K-native disk needs
+ * nsectors to be a multiple of 8. */
+static int block_size[NOSPRD] = {
+	SECTOR_SIZE, SECTOR_SIZE, SECTOR_SIZE, SECTOR_SIZE
+};
+module_param_array(block_size, int, NULL, 0);
+
+/* Files on a device whose writeback parameter is set are opened without
+ * O_SYNC, so small writes collect in the page cache and reach the request
+ * function merged; fsync() flushes them.  OSPRDIOCSYNC changes this for
+ * one file. */
+static int writeback[NOSPRD];
+module_param_array(writeback, int, NULL, 0);
+
+/* Devices whose checksum parameter is set keep a CRC32C of every sector, so
+ * that stray writes into their memory are caught: reads are checked while
+ * verify_reads is set, and OSPRDIOCSCRUB checks the whole disk.  Devices in
+ * cache mode can't keep checksums. */
+static int checksum[NOSPRD];
+module_param_array(checksum, int, NULL, 0);
+static int verify_reads = 1;
+module_param(verify_reads, int, 0644);
+
+/* These module parameters set up the striped device /dev/osprde, which
+ * spreads its sectors over several ramdisks.  stripe_members is a bitmask
+ * of the ramdisks to use (bit i stands for /dev/osprd('a' + i)); 0, the
+ * default, means no striped device.  stripe_chunk is the number of
+ * consecutive sectors placed on one ramdisk before moving to the next:
+ * "insmod osprd.ko stripe_members=15 stripe_chunk=16". */
+static int stripe_members = 0;
+module_param(stripe_members, int, 0);
+static int stripe_chunk = 8;
+module_param(stripe_chunk, int, 0);
+
+/* These module parameters put devices in cache mode.  backing[i] names a
+ * file or block device that /dev/osprd('a' + i) stores its data in, using
+ * its nsectors sectors of memory as a write-back cache; the disk is as big
+ * as the backing file.  Dirty cache lines are written back every few
+ * seconds, or as soon as more than dirty_ratio percent of the cache is
+ * dirty: "insmod osprd.ko nsectors=8192 backing=/tmp/disk.img". */
+static char *backing[NOSPRD];
+module_param_array(backing, charp, NULL, 0);
+static int dirty_ratio = 40;
+module_param(dirty_ratio, int, 0);
+
+/* The striped device.  It has no queue lock of its own: each piece of an
+ * I/O is copied under the queue lock of the ramdisk it lives on, so I/Os
+ * to different ramdisks proceed in parallel. */
+typedef struct osprd_stripe {
+	osprd_info_t *members[NOSPRD];	// Ramdisks, in striping order
+	unsigned nmembers;
+	unsigned chunk;			// Sectors per chunk
+	unsigned long nsectors;		// Size of the striped device
+
+	struct request_queue *queue;
+	struct gendisk *gd;
+} osprd_stripe_t;
+
+static osprd_stripe_t stripe;
+
+/* Serializes mirror configuration, so no two devices end up mirroring each
+ * other. */
+static spinlock_t mirror_config_lock;
+
 
 // Declare useful helper functions
 
@@ -155,33 +497,23 @@ void addToPidList(struct pidList** l, struct process* p)
 /* Precondition: l is the pidList specified to remove the pid value p from. */
 void removeFromPidList(struct pidList** l, pid_t p)
 {
-	struct pidNode* cur;
+	struct pidNode** pos;
 	struct pidNode* deleteMe;
 
-	if (l == NULL)
-		return;
-
-	cur = (*l)->head;
-	if (cur == NULL)
+	if (*l == NULL)
 		return;
 
-	if (cur->proc->info->pid == p) {
-		(*l)->head = cur->next;
-		kfree(cur->proc);
-		kfree(cur); // kfree: frees kernel memory
-		(*l)->size = (*l)->size - 1;
-	}
-	/* Remove other occurences of p in the list. */
-	while (cur->next != NULL) {
-		if (cur->next->proc->info->pid == p) {
-			deleteMe = cur->next;
-			cur->next = cur->next->next;
+	pos = &((*l)->head);
+	while (*pos != NULL) {
+		if ((*pos)->proc->info->pid == p) {
+			deleteMe = *pos;
+			*pos = deleteMe->next;
 			kfree(deleteMe->proc);
-			kfree(deleteMe);
+			kfree(deleteMe); // kfree: frees kernel memory
 			(*l)->size = (*l)->size - 1;
-			return;
+			break;
 		}
-		cur = cur->next;
+		pos = &((*pos)->next);
 	}
 	/* Deallocate list if there are no more nodes. */
 	if ((*l)->size == 0) {
@@ -207,56 +539,65 @@ struct process* isInPidList(struct pidList* l, pid_t p)
 	return NULL;
 }
 
-/* Precondition: l is the ticketList to add to and t is the ticket to be added. */
-void addToTicketList(struct ticketList** l, unsigned t)
+/* Returns the current time in microseconds. */
+static unsigned long long now_usecs(void)
+{
+	struct timeval tv;
+	do_gettimeofday(&tv);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Precondition: l is the ticketList to add to and t is the ticket to be added,
+ * taken now by a request of class cls.
+ * Tickets are taken in increasing order, so appending keeps the oldest
+ * ticket at the list's head. */
+void addToTicketList(struct ticketList** l, unsigned t, int cls)
 {
 	struct ticketNode* newNode;
 	/* Just add a ticket node if the list is empty. */
 	if (*l == NULL) {
 		*l = kzalloc(sizeof(struct ticketList), GFP_ATOMIC);
-		(*l)->head = NULL;
+		(*l)->head = (*l)->tail = NULL;
 		(*l)->size = 0;
 	}
 	newNode = kzalloc(sizeof(struct ticketNode), GFP_ATOMIC);
 	newNode->ticket = t;
-	if ((*l)->head == NULL) {
-		(*l)->head = newNode;
-		newNode->next = NULL;
-	}
-	else {
-		newNode->next = (*l)->head;
+	newNode->cls = cls;
+	newNode->since = jiffies;
+	newNode->start = now_usecs();
+	newNode->next = NULL;
+	if ((*l)->tail != NULL)
+		(*l)->tail->next = newNode;
+	else
 		(*l)->head = newNode;
-	}
+	(*l)->tail = newNode;
+	(*l)->size = (*l)->size + 1;
 }
 
-/* Precondition: l is the ticketList specified to remove the ticket t from. */
+/* Precondition: l is the ticketList specified to remove the ticket t from.
+ * Tickets are usually served from the head, which is found at once. */
 void removeFromTicketList(struct ticketList** l, unsigned t)
 {
-	struct ticketNode* cur;
+	struct ticketNode** pos;
 	struct ticketNode* deleteMe;
+	struct ticketNode* prev = NULL;
 
-	if (l == NULL)
-		return;
-
-	cur = (*l)->head;
-	if (cur == NULL)
+	if (*l == NULL)
 		return;
 
-	if (cur->ticket == t) {
-		(*l)->head = cur->next;
-		kfree(cur);
-		(*l)->size = (*l)->size - 1;
-	}
-	/* Remove other occurrences of t in the list. */
-	while (cur->next != NULL) {
-		if (cur->next->ticket == t) {
-			deleteMe = cur->next;
-			cur->next = cur->next->next;
-			kfree(deleteMe);
+	pos = &((*l)->head);
+	while (*pos != NULL) {
+		if ((*pos)->ticket == t) {
+			deleteMe = *pos;
+			*pos = deleteMe->next;
+			if ((*l)->tail == deleteMe)
+				(*l)->tail = prev;
+			kfree(deleteMe); // kfree: frees kernel memory
 			(*l)->size = (*l)->size - 1;
-			return;
+			break;
 		}
-		cur = cur->next;
+		prev = *pos;
+		pos = &((*pos)->next);
 	}
 	/* Deallocate list if there are no more nodes. */
 	if ((*l)->size == 0) {
@@ -265,34 +606,103 @@ void removeFromTicketList(struct ticketList** l, unsigned t)
 	}
 }
 
-/* Precondition: l is the ticketList specified to see if the ticket t exists. 
- * Postcondition: Returns 1 if t is in the list and 0 otherwise. */
-int isInTicketList(struct ticketList* l, unsigned t)
+/* Precondition: l is the ticketList specified to find the ticket t in. 
+ * Postcondition: Returns t's node, or NULL if t is not in the list. */
+struct ticketNode* findInTicketList(struct ticketList* l, unsigned t)
 {
 	struct ticketNode* cur;
 	if (l == NULL)
-		return 0;
+		return NULL;
 	cur = l->head;
 	while (cur != NULL) {
 		if (cur->ticket == t)
-			return 1;
+			return cur;
 		cur = cur->next;
 	}
-	return 0;
+	return NULL;
 }
 
-/* Increment ticket_tail so that exited tickets are avoided. */
-void incrementTicket(osprd_info_t* d)
+/* Point ticket_tail at the waiting ticket to serve next: the one of the
+ * highest class, where every prio_aging_ms of waiting counts as one class
+ * more, and the oldest of those.  Within a class the oldest ticket has
+ * also aged the most, so only the head of each class's queue is looked
+ * at.  If nobody is waiting, ticket_tail is ticket_head, so the next
+ * ticket taken is served at once.
+ * Precondition: d->mutex is held. */
+void pickNextTicket(osprd_info_t* d)
 {
-	d->ticket_tail = d->ticket_tail + 1;
-	while (1) {
-		if (!isInTicketList(d->exitedTickets, d->ticket_tail))
-			break; // The next process is alive (not exited).
-		else
-			removeFromTicketList(&(d->exitedTickets), 
-				d->ticket_tail);
-		d->ticket_tail = d->ticket_tail + 1;
+	unsigned long aging = msecs_to_jiffies(prio_aging_ms);
+	struct ticketNode* cur;
+	struct ticketNode* best = NULL;
+	long cls, bestCls = -1;
+	int c;
+
+	for (c = 0; c < OSPRD_NCLASSES; c++) {
+		if (d->waitingTickets[c] == NULL)
+			continue;
+		cur = d->waitingTickets[c]->head;
+		cls = cur->cls;
+		if (prio_aging_ms > 0)
+			cls += (jiffies - cur->since) / aging;
+		if (cls > bestCls || (cls == bestCls &&
+				      (int) (cur->ticket - best->ticket) < 0)) {
+			best = cur;
+			bestCls = cls;
+		}
+	}
+	d->ticket_tail = best ? best->ticket : d->ticket_head;
+}
+
+/* Returns the queue holding waiting ticket t, or NULL if t isn't waiting.
+ * The served ticket is normally at the head of its queue.
+ * Precondition: d->mutex is held. */
+static struct ticketList** ticketQueue(osprd_info_t* d, unsigned t)
+{
+	int c;
+
+	for (c = 0; c < OSPRD_NCLASSES; c++)
+		if (d->waitingTickets[c] != NULL &&
+		    d->waitingTickets[c]->head->ticket == t)
+			return &(d->waitingTickets[c]);
+	for (c = 0; c < OSPRD_NCLASSES; c++)
+		if (findInTicketList(d->waitingTickets[c], t) != NULL)
+			return &(d->waitingTickets[c]);
+	return NULL;
+}
+
+/* Take a ticket for a request of class cls.  It may be served ahead of
+ * older tickets of lower classes.
+ * Precondition: d->mutex is held. */
+unsigned takeTicket(osprd_info_t* d, int cls)
+{
+	unsigned t = d->ticket_head;
+	d->ticket_head = d->ticket_head + 1;
+	addToTicketList(&(d->waitingTickets[cls]), t, cls);
+	pickNextTicket(d);
+	return t;
+}
+
+/* Ticket t has just been granted the lock: record how long it waited,
+ * then move on to the next ticket.  t was ticket_tail when its holder
+ * was let in, but ticket_tail may have moved to a more urgent ticket
+ * since, if d->mutex was dropped on the way.
+ * Precondition: d->mutex is held. */
+void incrementTicket(osprd_info_t* d, unsigned t)
+{
+	struct ticketList** queue = ticketQueue(d, t);
+	struct ticketNode* served;
+	unsigned long long wait;
+
+	served = queue ? findInTicketList(*queue, t) : NULL;
+	if (served != NULL) {
+		wait = now_usecs() - served->start;
+		d->classAcquires[served->cls]++;
+		d->classWait[served->cls] += wait;
+		if (wait > d->classMaxWait[served->cls])
+			d->classMaxWait[served->cls] = wait;
+		removeFromTicketList(queue, t);
 	}
+	pickNextTicket(d);
 }
 
 /*
@@ -315,93 +725,2740 @@ static void for_each_open_file(struct task_struct *task,
 						osprd_info_t *user_data),
 			       osprd_info_t *user_data);
 
-/* Pass this function into the second argument of for_each_open_file to see if
- * the current process has any locks in other ramdisks. */
-void checkForOtherLocks(struct file *filp, osprd_info_t *data)
+/*
+ * get_open_file(d)
+ *   Return a file that the current process has open on ramdisk d, with a
+ *   reference taken (release it with fput()), or NULL if there is none.
+ */
+static struct file *get_open_file(osprd_info_t *d);
+
+/* Returns 1 if the current process holds a lock on any ramdisk, in which
+ * case a new lock request could deadlock.  Locks are recorded by pid, so
+ * the devices are checked directly rather than by walking the process's
+ * open files.
+ * Precondition: no device mutex is held. */
+static int holds_any_lock(void)
 {
-        osprd_info_t* dev = file2osprd(filp);
-        if (dev != NULL) {
-                if (isInPidList(dev->writeProcs, current->pid) ||
-                        isInPidList(dev->readProcs, current->pid))
-                        data->isHoldingOtherLocks = 1;
-        }
+	int i, held = 0;
+	for (i = 0; i < NOSPRD && !held; i++) {
+		osp_spin_lock(&(osprds[i].mutex));
+		if (isInPidList(osprds[i].writeProcs, current->pid) ||
+			isInPidList(osprds[i].readProcs, current->pid))
+			held = 1;
+		osp_spin_unlock(&(osprds[i].mutex));
+	}
+	return held;
 }
 
 /*
- * osprd_process_request(d, req)
- *   Called when the user reads or writes a sector.
- *   Should perform the read or write, as appropriate.
+ * Change rings
+ *   Subscribers set up a ring with OSPRDIOCRING and mmap() it; the write path
+ *   appends one entry per written sector.
  */
-static void osprd_process_request(osprd_info_t *d, struct request *req)
+
+/* Returns the change ring set up on filp, or NULL.
+ * Precondition: d->qlock is held. */
+static struct ringSub* find_change_ring(osprd_info_t *d, struct file *filp)
 {
-	struct pidNode* cur;
-	struct process* p;
-	uint8_t* dPtr;
-	unsigned int reqType;
+	struct ringSub* sub;
+	for (sub = d->rings; sub != NULL; sub = sub->next)
+		if (sub->filp == filp)
+			return sub;
+	return NULL;
+}
+
+/* Set up a change ring on filp.  Returns 0, -EINVAL for unknown flags,
+ * -EBUSY if filp already has a ring, or -ENOMEM. */
+static int setup_change_ring(osprd_info_t *d, struct file *filp,
+			     unsigned flags)
+{
+	struct ringSub* sub;
+
+	if (flags & ~OSPRD_RING_PAYLOAD)
+		return -EINVAL;
+
+	sub = kzalloc(sizeof(struct ringSub), GFP_KERNEL);
+	if (sub == NULL)
+		return -ENOMEM;
+	/* vmalloc_user: zeroed memory that may be mapped into user space. */
+	sub->ring = vmalloc_user(sizeof(struct osprd_ring));
+	if (sub->ring == NULL) {
+		kfree(sub);
+		return -ENOMEM;
+	}
+	sub->filp = filp;
+	sub->ring->head = 1;
+	sub->ring->flags = flags;
+
+	spin_lock_irq(&d->qlock);
+	if (find_change_ring(d, filp) != NULL) {
+		spin_unlock_irq(&d->qlock);
+		vfree(sub->ring);
+		kfree(sub);
+		return -EBUSY;
+	}
+	sub->next = d->rings;
+	d->rings = sub;
+	spin_unlock_irq(&d->qlock);
+	return 0;
+}
+
+/* Remove filp's change ring, if any. */
+static void remove_change_ring(osprd_info_t *d, struct file *filp)
+{
+	struct ringSub** pos;
+	struct ringSub* sub = NULL;
+
+	spin_lock_irq(&d->qlock);
+	for (pos = &(d->rings); *pos != NULL; pos = &((*pos)->next))
+		if ((*pos)->filp == filp) {
+			sub = *pos;
+			*pos = sub->next;
+			break;
+		}
+	spin_unlock_irq(&d->qlock);
+
+	if (sub != NULL) {
+		vfree(sub->ring);
+		kfree(sub);
+	}
+}
+
+/* Append the write of 'nsect' sectors at 'sector' to every change ring.
+ * 'data' holds the sectors' new contents.
+ * Precondition: d->qlock is held. */
+static void record_change(osprd_info_t *d, unsigned long sector,
+			  unsigned nsect, const uint8_t *data)
+{
+	struct ringSub* sub;
+	struct osprd_ring* ring;
+	struct osprd_ring_entry* e;
+	unsigned i, seq, skip;
+
+	/* Only the last OSPRD_RING_ENTRIES sectors of a long write would stay
+	 * in the ring.  The others are skipped, but their change numbers are
+	 * still used up, so watchers see that they missed changes. */
+	skip = nsect > OSPRD_RING_ENTRIES ? nsect - OSPRD_RING_ENTRIES : 0;
+	for (sub = d->rings; sub != NULL; sub = sub->next) {
+		ring = sub->ring;
+		ring->head = ring->head + skip;
+		for (i = skip; i < nsect; i++) {
+			seq = ring->head;
+			e = &(ring->entries[seq % OSPRD_RING_ENTRIES]);
+			/* Invalidate the entry while it is rewritten, so
+			 * readers never take a half-written one. */
+			e->seq = 0;
+			smp_wmb();
+			e->sector = sector + i;
+			if (ring->flags & OSPRD_RING_PAYLOAD)
+				memcpy(e->data, data + i * SECTOR_SIZE,
+				       SECTOR_SIZE);
+			smp_wmb();
+			e->seq = seq;
+			smp_wmb();
+			ring->head = seq + 1;
+		}
+	}
+}
+
+/* Mark 'nsect' sectors at 'sector' for copying to d's mirror, and make sure
+ * mirror_work will run.  The writer doesn't wait for the copy.
+ * Precondition: d->qlock is held. */
+static void mirror_mark_dirty(osprd_info_t *d, unsigned long sector,
+			      unsigned nsect)
+{
+	unsigned i;
+
+	for (i = 0; i < nsect; i++)
+		if (!__test_and_set_bit(sector + i, d->mirrorDirty))
+			d->mirrorLag++;
+	schedule_work(&d->mirrorWork);
+}
+
+/* Bookkeeping for a write of 'nsect' sectors at 'sector' that has just been
+ * copied to 'data' in d->data: advance the generation, publish the change
+ * to subscribers' change rings, and queue it for the mirror.
+ * Precondition: d->qlock is held. */
+static void note_write(osprd_info_t *d, unsigned long sector, unsigned nsect,
+		       const uint8_t *data)
+{
+	unsigned i;
+
+	d->generation = d->generation + 1;
+	for (i = 0; i < nsect; i++)
+		d->sectorGen[sector + i] = d->generation;
+	if (d->rings != NULL)
+		record_change(d, sector, nsect, data);
+	if (d->mirror != NULL)
+		mirror_mark_dirty(d, sector, nsect);
+}
+
+/*
+ * Snapshots
+ *   Before a sector is overwritten, its contents are saved in every
+ *   snapshot that doesn't have them yet.  Those are the snapshots taken
+ *   since the sector was last written, which are the newest ones, so the
+ *   saved copy is shared: a sector's copy in one snapshot may also be in
+ *   the snapshots next to it in the list, and nowhere else.
+ *   Copies are allocated a block of up to SNAP_BLOCK_SECTORS at a time,
+ *   and every snapshot that needed some of a block's copies holds it.  A
+ *   snapshot is freed by dropping its holds, so only the copies that exist
+ *   are visited, and that happens outside qlock.
+ */
+
+/* Save the sectors in [sector, end), at most SNAP_BLOCK_SECTORS of them,
+ * in the snapshots that need them before they are overwritten.  The
+ * copies are allocated atomically, as one block; if that fails, the
+ * snapshots that needed them are marked lost.
+ * Precondition: d->qlock is held. */
+static void snapshot_preserve_block(osprd_info_t *d, unsigned long sector,
+				    unsigned long end)
+{
+	struct snapshot* s;
+	struct snapBlock* b = NULL;
+	unsigned long i;
+	unsigned n = 0, depth, users = 0;
+
+	/* Count the copies needed, and the snapshots needing any. */
+	for (i = sector; i < end; i++) {
+		depth = 0;
+		for (s = d->snapshots; s != NULL && s->saved[i] == NULL;
+		     s = s->next)
+			depth++;
+		if (depth > 0)
+			n++;
+		users = max(users, depth);
+	}
+	if (n == 0)
+		return;		// Every snapshot has them already
+
+	b = kmalloc(sizeof(struct snapBlock)
+		    + users * sizeof(struct snapHold), GFP_ATOMIC);
+	if (b != NULL && !(b->data = kmalloc(n * SECTOR_SIZE, GFP_ATOMIC))) {
+		kfree(b);
+		b = NULL;
+	}
+	if (b == NULL) {
+		for (s = d->snapshots; users > 0; s = s->next, users--)
+			s->lost = 1;
+		if (printk_ratelimit())
+			printk(KERN_WARNING "osprd: %s: out of memory for a "
+			       "snapshot\n", d->gd->disk_name);
+		return;
+	}
+
+	for (i = sector, n = 0; i < end; i++) {
+		if (d->snapshots->saved[i] != NULL)
+			continue;
+		memcpy(b->data + n * SECTOR_SIZE, d->data + i * SECTOR_SIZE,
+		       SECTOR_SIZE);
+		for (s = d->snapshots; s != NULL && s->saved[i] == NULL;
+		     s = s->next)
+			s->saved[i] = b->data + n * SECTOR_SIZE;
+		n++;
+	}
+	atomic_set(&b->users, users);
+	for (s = d->snapshots, i = 0; i < users; s = s->next, i++) {
+		b->holds[i].block = b;
+		b->holds[i].next = s->blocks;
+		s->blocks = &(b->holds[i]);
+	}
+}
+
+/* Save 'nsect' sectors at 'sector' in the snapshots that need them before
+ * they are overwritten.
+ * Precondition: d->qlock is held. */
+static void snapshot_preserve(osprd_info_t *d, unsigned long sector,
+			      unsigned nsect)
+{
+	unsigned long end = sector + nsect, n;
+
+	for (; sector < end; sector += n) {
+		n = min_t(unsigned long, end - sector, SNAP_BLOCK_SECTORS);
+		snapshot_preserve_block(d, sector, sector + n);
+	}
+}
+
+/*
+ * Checksums
+ *   A sector's checksum is its CRC32C, computed after each write from the
+ *   data just copied, while it is still in the cache.  Every sector has a
+ *   checksum of its own, so the CPU's crc32 instruction (SSE4.2), when
+ *   there is one, works on four sectors at once: each crc32 waits for the
+ *   one before it on the same sector, but not for the others.  Otherwise
+ *   the kernel's crc32c() is used.  Both give the same values.
+ */
+
+static int crc_hw;			// Set if the CPU has SSE4.2
+
+#ifdef CONFIG_X86
+#ifndef X86_FEATURE_XMM4_2
+#define X86_FEATURE_XMM4_2	(4 * 32 + 20)
+#endif
+
+/* crc = crc32(crc, w).  The instruction is spelled out for assemblers that
+ * predate it. */
+#ifdef CONFIG_X86_64
+#define CRC32_STEP(crc, w) asm(".byte 0xf2, 0x48, 0x0f, 0x38, 0xf1, 0xf1" \
+			       : "=S" (crc) : "0" (crc), "c" (w))
+#else
+#define CRC32_STEP(crc, w) asm(".byte 0xf2, 0x0f, 0x38, 0xf1, 0xf1" \
+			       : "=S" (crc) : "0" (crc), "c" (w))
+#endif
+
+#define SECTOR_WORDS	(SECTOR_SIZE / sizeof(unsigned long))
+
+/* Checksum the four sectors at 'p' into crcs[0..3]. */
+static void crc4_hw(const uint8_t *p, u32 *crcs)
+{
+	const unsigned long *a = (const unsigned long *) p;
+	const unsigned long *b = a + SECTOR_WORDS;
+	const unsigned long *c = b + SECTOR_WORDS;
+	const unsigned long *d = c + SECTOR_WORDS;
+	u32 ca = ~0, cb = ~0, cc = ~0, cd = ~0;
+	unsigned i;
+
+	for (i = 0; i < SECTOR_WORDS; i++) {
+		CRC32_STEP(ca, a[i]);
+		CRC32_STEP(cb, b[i]);
+		CRC32_STEP(cc, c[i]);
+		CRC32_STEP(cd, d[i]);
+	}
+	crcs[0] = ca;
+	crcs[1] = cb;
+	crcs[2] = cc;
+	crcs[3] = cd;
+}
+
+static u32 crc_hw_sector(const uint8_t *p)
+{
+	const unsigned long *w = (const unsigned long *) p;
+	u32 crc = ~0;
+	unsigned i;
+
+	for (i = 0; i < SECTOR_WORDS; i++)
+		CRC32_STEP(crc, w[i]);
+	return crc;
+}
+#endif
+
+/* Set crcs[i] to the checksum of sector i at 'p', for i in [0, n). */
+static void sector_crcs(const uint8_t *p, unsigned long n, u32 *crcs)
+{
+#ifdef CONFIG_X86
+	if (crc_hw) {
+		for (; n >= 4; n -= 4, p += 4 * SECTOR_SIZE, crcs += 4)
+			crc4_hw(p, crcs);
+		for (; n > 0; n--, p += SECTOR_SIZE)
+			*crcs++ = crc_hw_sector(p);
+		return;
+	}
+#endif
+	for (; n > 0; n--, p += SECTOR_SIZE)
+		*crcs++ = crc32c(~0, p, SECTOR_SIZE);
+}
+
+/* Update the checksums of the 'nsect' sectors at 'sector' after a write. */
+static void update_checksums(osprd_info_t *d, unsigned long sector,
+			     unsigned long nsect)
+{
+	if (d->crcs)
+		sector_crcs(d->data + sector * SECTOR_SIZE, nsect,
+			    d->crcs + sector);
+}
+
+/* Returns the first of the 'nsect' sectors at 'sector' whose data doesn't
+ * match its checksum, or sector + nsect if they all do. */
+static unsigned long bad_sector(osprd_info_t *d, unsigned long sector,
+				unsigned long nsect)
+{
+	u32 crcs[64];
+	unsigned long n, i;
+
+	for (; nsect > 0; sector += n, nsect -= n) {
+		n = min_t(unsigned long, nsect, ARRAY_SIZE(crcs));
+		sector_crcs(d->data + sector * SECTOR_SIZE, n, crcs);
+		for (i = 0; i < n; i++)
+			if (crcs[i] != d->crcs[sector + i])
+				return sector + i;
+	}
+	return sector;
+}
+
+static int in_big_write(osprd_info_t *d, unsigned long sector);
+
+/* Check the 'nsect' sectors at 'sector' before they are read, if reads are
+ * verified.  Sectors a parallel write is still copying are passed over,
+ * since their data and checksums aren't in step yet.  Returns 0, or -EIO
+ * if one is bad.
+ * Precondition: d->qlock is held. */
+static int verify_read(osprd_info_t *d, unsigned long sector,
+		       unsigned long nsect)
+{
+	unsigned long end = sector + nsect, bad;
+
+	if (!d->crcs || !verify_reads)
+		return 0;
+	for (;; sector = bad + 1) {
+		bad = bad_sector(d, sector, end - sector);
+		if (bad == end)
+			return 0;
+		if (!in_big_write(d, bad))
+			break;
+	}
+	if (printk_ratelimit())
+		printk(KERN_WARNING "osprd: %s: sector %lu fails its checksum\n",
+		       d->gd->disk_name, bad);
+	return -EIO;
+}
+
+#ifdef CONFIG_X86
+/* Copy 'len' bytes, a multiple of 64, with SSE2 non-temporal stores.
+ * movnti stores from integer registers, so no FPU state needs saving. */
+static void memcpy_nt(void *dst, const void *src, size_t len)
+{
+	unsigned long *d = (unsigned long *) dst;
+	const unsigned long *s = (const unsigned long *) src;
+	size_t i, n = len / sizeof(unsigned long);
+
+	for (i = 0; i < n; i += 4) {
+		asm volatile("movnti %1, %0" : "=m" (d[i]) : "r" (s[i]));
+		asm volatile("movnti %1, %0" : "=m" (d[i + 1]) : "r" (s[i + 1]));
+		asm volatile("movnti %1, %0" : "=m" (d[i + 2]) : "r" (s[i + 2]));
+		asm volatile("movnti %1, %0" : "=m" (d[i + 3]) : "r" (s[i + 3]));
+	}
+	/* Non-temporal stores are weakly ordered; order them before
+	 * whatever tells others the data is there. */
+	asm volatile("sfence" : : : "memory");
+}
+#endif
+
+/* Returns 1 if a write of 'bytes' in all should bypass the caches. */
+static int use_nt_copy(unsigned long bytes)
+{
+#ifdef CONFIG_X86
+	return nt_copy_kb > 0 && bytes >= (unsigned long) nt_copy_kb * 1024
+		&& cpu_has_xmm2;
+#else
+	return 0;
+#endif
+}
+
+/* Copy 'len' bytes from 'src' to 'dst' in a disk's data, with
+ * non-temporal stores if 'nt' is set and the copy is aligned for them. */
+static void copy_to_disk(uint8_t *dst, const uint8_t *src, size_t len,
+			 int nt)
+{
+#ifdef CONFIG_X86
+	if (nt && ((unsigned long) dst & 15) == 0 && len % 64 == 0) {
+		memcpy_nt(dst, src, len);
+		return;
+	}
+#endif
+	memcpy(dst, src, len);
+}
+
+/* Returns 1 if data written to d may be read straight back, by its
+ * checksums or for a change ring's payload, so non-temporal stores would
+ * only send those reads to memory. */
+static int reads_back(osprd_info_t *d)
+{
+	return d->crcs != NULL || d->rings != NULL;
+}
+
+/* Write 'nsect' sectors from 'src' to d at 'sector', saving what they
+ * overwrite for snapshots, updating their checksums and doing
+ * note_write()'s bookkeeping.  'nt' is passed on to copy_to_disk() unless
+ * the data is read straight back.
+ * Precondition: d->qlock is held. */
+static void store_sectors(osprd_info_t *d, unsigned long sector,
+			  unsigned nsect, const uint8_t *src, int nt)
+{
+	if (d->snapshots != NULL)
+		snapshot_preserve(d, sector, nsect);
+	copy_to_disk(d->data + sector * SECTOR_SIZE, src, nsect * SECTOR_SIZE,
+		     nt && !reads_back(d));
+	update_checksums(d, sector, nsect);
+	note_write(d, sector, nsect, d->data + sector * SECTOR_SIZE);
+}
+
+/* Drop a reference to snapshot s of d, freeing it with the last one. */
+static void put_snapshot(osprd_info_t *d, struct snapshot *s)
+{
+	struct snapshot** pos;
+	struct snapHold* h;
+	struct snapHold* next;
+	struct snapBlock* b;
+
+	spin_lock_irq(&d->qlock);
+	if (--s->refs != 0) {
+		spin_unlock_irq(&d->qlock);
+		return;
+	}
+	pos = &(d->snapshots);
+	while (*pos != s)
+		pos = &((*pos)->next);
+	*pos = s->next;
+	spin_unlock_irq(&d->qlock);
+
+	/* Nobody can reach s now.  Free the blocks no other snapshot
+	 * holds. */
+	for (h = s->blocks; h != NULL; h = next) {
+		next = h->next;
+		b = h->block;
+		if (atomic_dec_and_test(&b->users)) {
+			kfree(b->data);
+			kfree(b);
+		}
+	}
+	vfree(s->saved);
+	kfree(s);
+}
+
+/* Returns the snapshot filp took on d with a new reference, or NULL. */
+static struct snapshot* get_file_snapshot(osprd_info_t *d, struct file *filp)
+{
+	struct snapReader* r;
+	struct snapshot* s = NULL;
+
+	spin_lock_irq(&d->qlock);
+	for (r = d->snapReaders; r != NULL; r = r->next)
+		if (r->filp == filp) {
+			s = r->snap;
+			s->refs++;
+			break;
+		}
+	spin_unlock_irq(&d->qlock);
+	return s;
+}
+
+/* Take a snapshot of d for filp.  Returns 0, -EINVAL in cache mode (where
+ * the disk isn't all in memory), -EBUSY if filp already has a snapshot,
+ * -ENOMEM, or -ERESTARTSYS if interrupted waiting out parallel writes. */
+static int take_snapshot(osprd_info_t *d, struct file *filp)
+{
+	struct snapshot* s = kzalloc(sizeof(struct snapshot), GFP_KERNEL);
+	struct snapReader* r = kmalloc(sizeof(struct snapReader), GFP_KERNEL);
+	uint8_t** saved = vmalloc(d->nsectors * sizeof(uint8_t*));
+	struct snapReader* cur;
+	int ret = 0;
+
+	if (d->backing != NULL)
+		ret = -EINVAL;
+	else if (s == NULL || r == NULL || saved == NULL)
+		ret = -ENOMEM;
+	if (ret != 0)
+		goto out;
+	memset(saved, 0, d->nsectors * sizeof(uint8_t*));
+
+	/* Parallel writes in flight were not saved for the new snapshot and
+	 * are still changing the disk under it; let them finish first. */
+	spin_lock_irq(&d->qlock);
+	while (!list_empty(&d->bigWrites)) {
+		spin_unlock_irq(&d->qlock);
+		if (wait_event_interruptible(d->bigWriteq,
+					     list_empty(&d->bigWrites))) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		spin_lock_irq(&d->qlock);
+	}
+	for (cur = d->snapReaders; cur != NULL; cur = cur->next)
+		if (cur->filp == filp)
+			break;
+	if (cur != NULL) {
+		spin_unlock_irq(&d->qlock);
+		ret = -EBUSY;
+		goto out;
+	}
+	if (d->snapshots == NULL || d->snapshots->lost
+	    || d->snapshots->generation != d->generation) {
+		s->generation = d->generation;
+		s->saved = saved;
+		s->next = d->snapshots;
+		d->snapshots = s;
+		s = NULL, saved = NULL;
+	}
+	d->snapshots->refs++;
+	r->filp = filp;
+	r->snap = d->snapshots;
+	r->next = d->snapReaders;
+	d->snapReaders = r;
+	r = NULL;
+	spin_unlock_irq(&d->qlock);
+
+ out:
+	kfree(s);
+	kfree(r);
+	if (saved != NULL)
+		vfree(saved);
+	return ret;
+}
+
+/* Drop filp's snapshot of d, if it has one. */
+static void drop_snapshot(osprd_info_t *d, struct file *filp)
+{
+	struct snapReader** pos;
+	struct snapReader* r = NULL;
+
+	spin_lock_irq(&d->qlock);
+	for (pos = &(d->snapReaders); *pos != NULL; pos = &((*pos)->next))
+		if ((*pos)->filp == filp) {
+			r = *pos;
+			*pos = r->next;
+			break;
+		}
+	spin_unlock_irq(&d->qlock);
+
+	if (r != NULL) {
+		put_snapshot(d, r->snap);
+		kfree(r);
+	}
+}
+
+/* read() from snapshot s of d: copy 'count' bytes at *ppos to 'buf', a page
+ * at a time through a bounce buffer, since qlock can't be held across
+ * copy_to_user(). */
+static ssize_t read_snapshot(osprd_info_t *d, struct snapshot *s,
+			     char __user *buf, size_t count, loff_t *ppos)
+{
+	unsigned long size = d->nsectors * SECTOR_SIZE;
+	unsigned long pos, sector, off;
+	uint8_t *page, *src;
+	size_t done = 0, n, len, i;
+	ssize_t r = 0;
+
+	if (*ppos >= size)
+		return 0;
+	pos = (unsigned long) *ppos;
+	if (count > size - pos)
+		count = size - pos;
+	page = (uint8_t *) __get_free_page(GFP_KERNEL);
+	if (page == NULL)
+		return -ENOMEM;
+
+	while (done < count) {
+		n = min_t(size_t, count - done, PAGE_SIZE);
+		spin_lock_irq(&d->qlock);
+		if (s->lost) {
+			spin_unlock_irq(&d->qlock);
+			r = -EIO;
+			break;
+		}
+		for (i = 0; i < n; i += len) {
+			sector = (pos + i) / SECTOR_SIZE;
+			off = (pos + i) % SECTOR_SIZE;
+			len = min_t(size_t, n - i, SECTOR_SIZE - off);
+			src = s->saved[sector];
+			if (src == NULL)
+				src = d->data + sector * SECTOR_SIZE;
+			memcpy(page + i, src + off, len);
+		}
+		spin_unlock_irq(&d->qlock);
+		if (copy_to_user(buf + done, page, n)) {
+			r = -EFAULT;
+			break;
+		}
+		done += n;
+		pos += n;
+	}
+
+	free_page((unsigned long) page);
+	*ppos = pos;
+	return done != 0 ? done : r;
+}
+
+/* Report the sectors written since generation c->since into the user's
+ * bitmap.  Sectors are scanned a chunk at a time so qlock isn't held for
+ * long; a sector written during the scan may be reported although it is
+ * newer than c->generation, which only makes the next copy redundant.
+ * Returns 0, -ENOSPC if the bitmap is too small, or -EFAULT. */
+static int get_changed_sectors(osprd_info_t *d, struct osprd_changes *c)
+{
+	unsigned char chunk[128];	// Bits for 1024 sectors
+	unsigned start, n, i;
+
+	if (c->nsectors < d->nsectors) {
+		c->nsectors = d->nsectors;
+		return -ENOSPC;
+	}
+	c->nsectors = d->nsectors;
+
+	spin_lock_irq(&d->qlock);
+	c->generation = d->generation;
+	spin_unlock_irq(&d->qlock);
+
+	for (start = 0; start < d->nsectors; start += n) {
+		n = min_t(unsigned, d->nsectors - start, sizeof(chunk) * 8);
+		memset(chunk, 0, sizeof(chunk));
+		spin_lock_irq(&d->qlock);
+		for (i = 0; i < n; i++)
+			if (d->sectorGen[start + i] > c->since)
+				chunk[i / 8] |= 1 << (i % 8);
+		spin_unlock_irq(&d->qlock);
+		if (copy_to_user(c->bitmap + start / 8, chunk, (n + 7) / 8))
+			return -EFAULT;
+	}
+	return 0;
+}
+
+
+/*
+ * Mirroring
+ *   Writes mark sectors dirty in mirrorDirty; mirror_work copies them to the
+ *   mirror in batches from the shared kernel workqueue.
+ */
+
+#define MIRROR_BATCH	8	// Sectors copied per batch
+
+/* Copy d's dirty sectors to its mirror until none are left.  Each batch is
+ * taken out of d under d->qlock and then written to the mirror under the
+ * mirror's qlock, so the two locks are never held together.  The copy goes
+ * through store_sectors(), so the mirror's own change tracking and mirror see
+ * it like any other write. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+static void mirror_work(void *data)
+{
+	osprd_info_t *d = (osprd_info_t *) data;
+#else
+static void mirror_work(struct work_struct *work)
+{
+	osprd_info_t *d = container_of(work, osprd_info_t, mirrorWork);
+#endif
+	osprd_info_t *m;
+	uint8_t *buf;
+	unsigned long start, pos = 0;
+	unsigned n;
+
+	/* If the buffer can't be had, the sectors stay dirty, and the next
+	 * write to d tries again. */
+	buf = kmalloc(MIRROR_BATCH * SECTOR_SIZE, GFP_KERNEL);
+	if (buf == NULL)
+		return;
+
+	spin_lock_irq(&d->qlock);
+	/* The work may run on two CPUs at once; one copier is enough, and
+	 * two could reorder writes of the same sector. */
+	if (d->mirrorBusy) {
+		spin_unlock_irq(&d->qlock);
+		kfree(buf);
+		return;
+	}
+	d->mirrorBusy = 1;
+
+	while ((m = d->mirror) != NULL && d->mirrorLag != 0) {
+		start = find_next_bit(d->mirrorDirty, d->nsectors, pos);
+		if (start >= d->nsectors)
+			start = find_next_bit(d->mirrorDirty, d->nsectors, 0);
+		for (n = 0; n < MIRROR_BATCH && start + n < d->nsectors
+			     && test_bit(start + n, d->mirrorDirty); n++)
+			__clear_bit(start + n, d->mirrorDirty);
+		d->mirrorLag -= n;
+		memcpy(buf, d->data + start * SECTOR_SIZE, n * SECTOR_SIZE);
+		spin_unlock_irq(&d->qlock);
+
+		spin_lock_irq(&m->qlock);
+		store_sectors(m, start, n, buf, 0);
+		spin_unlock_irq(&m->qlock);
+
+		pos = start + n;
+		cond_resched();
+		spin_lock_irq(&d->qlock);
+		d->mirrorCopied += n;
+	}
+
+	d->mirrorBusy = 0;
+	spin_unlock_irq(&d->qlock);
+	kfree(buf);
+}
+
+/* Start mirroring d onto device 'target', or stop if target is
+ * OSPRD_MIRROR_NONE.  A new mirror gets a full copy of d.  Returns 0,
+ * -EINVAL for a bad device index or a device in cache mode (whose data
+ * isn't all in memory), or -ELOOP if the mirror already mirrors to d,
+ * directly or through other devices (each copy would be mirrored back
+ * forever). */
+static int set_mirror(osprd_info_t *d, int target)
+{
+	osprd_info_t *m = NULL, *p;
+
+	if (target != OSPRD_MIRROR_NONE) {
+		if (target < 0 || target >= NOSPRD)
+			return -EINVAL;
+		m = &osprds[target];
+		if (d->backing != NULL || m->backing != NULL)
+			return -EINVAL;
+	}
+
+	spin_lock(&mirror_config_lock);
+	for (p = m; p != NULL; p = p->mirror)
+		if (p == d) {
+			spin_unlock(&mirror_config_lock);
+			return -ELOOP;
+		}
+
+	spin_lock_irq(&d->qlock);
+	d->mirror = m;
+	if (m != NULL) {
+		bitmap_fill(d->mirrorDirty, d->nsectors);
+		d->mirrorLag = d->nsectors;
+		schedule_work(&d->mirrorWork);
+	} else {
+		bitmap_zero(d->mirrorDirty, d->nsectors);
+		d->mirrorLag = 0;
+	}
+	spin_unlock_irq(&d->qlock);
+	spin_unlock(&mirror_config_lock);
+	return 0;
+}
+
+/*
+ * Tracing
+ *   Each CPU records events in its own buffer, so tracing adds no shared
+ *   cache lines to the request path.  The buffer's lock is only contended
+ *   by the reader of /proc/osprdtrace.  A full buffer drops new events and
+ *   counts them; the count is reported in the stream as one
+ *   OSPRD_TRACE_LOST event.
+ */
+
+struct traceBuf {
+	spinlock_t lock;
+	unsigned head;			// Events read so far
+	unsigned tail;			// Events recorded so far
+	unsigned lost;			// Events dropped since the last read
+	struct osprd_trace_event events[0];	// trace_size of them
+};
+
+static struct traceBuf *trace_bufs[NR_CPUS];
+static struct proc_dir_entry *trace_entry;
+
+/* Record an event of 'type' on d in this CPU's trace buffer.  Callers check
+ * 'trace' first, so tracing costs one test while it is off. */
+static void trace_event(osprd_info_t *d, int type, int write, unsigned cmd,
+			unsigned long sector, unsigned long arg)
+{
+	struct traceBuf *b;
+	struct osprd_trace_event *e;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	b = trace_bufs[smp_processor_id()];
+	if (b != NULL) {
+		spin_lock(&b->lock);
+		if (b->tail - b->head == (unsigned) trace_size)
+			b->lost++;
+		else {
+			e = &(b->events[b->tail % trace_size]);
+			e->usecs = now_usecs();
+			e->pid = current->pid;
+			e->sector = sector;
+			e->arg = arg;
+			e->type = type;
+			e->dev = d - osprds;
+			e->cmd = cmd;
+			e->write = write;
+			b->tail++;
+		}
+		spin_unlock(&b->lock);
+	}
+	local_irq_restore(flags);
+}
+
+/* read() on /proc/osprdtrace: drain as many whole events as fit in 'buf'
+ * and one page, taking the CPUs' buffers in turn.  Returns 0 once they are
+ * all empty. */
+static ssize_t trace_read(struct file *filp, char __user *buf, size_t count,
+			  loff_t *ppos)
+{
+	struct osprd_trace_event *events;
+	struct traceBuf *b;
+	size_t max, n = 0;
+	int cpu;
+
+	max = min_t(size_t, count, PAGE_SIZE)
+		/ sizeof(struct osprd_trace_event);
+	if (max == 0)
+		return -EINVAL;
+	events = (struct osprd_trace_event *) __get_free_page(GFP_KERNEL);
+	if (events == NULL)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		if ((b = trace_bufs[cpu]) == NULL)
+			continue;
+		spin_lock_irq(&b->lock);
+		if (b->lost != 0 && n < max) {
+			memset(&events[n], 0, sizeof(struct osprd_trace_event));
+			events[n].usecs = now_usecs();
+			events[n].type = OSPRD_TRACE_LOST;
+			events[n].arg = b->lost;
+			b->lost = 0;
+			n++;
+		}
+		for (; n < max && b->head != b->tail; n++, b->head++)
+			events[n] = b->events[b->head % trace_size];
+		spin_unlock_irq(&b->lock);
+	}
+
+	if (copy_to_user(buf, events, n * sizeof(struct osprd_trace_event)))
+		n = 0;
+	free_page((unsigned long) events);
+	return n * sizeof(struct osprd_trace_event);
+}
+
+static struct file_operations trace_fops = {
+	.owner = THIS_MODULE,
+	.read = trace_read
+};
+
+/* Allocate the trace buffers and create /proc/osprdtrace.  Tracing is
+ * simply unavailable if that fails. */
+static void setup_trace(void)
+{
+	int cpu;
+
+	if (trace_size <= 0)
+		return;
+	for_each_possible_cpu(cpu) {
+		trace_bufs[cpu] = vmalloc(sizeof(struct traceBuf) +
+			trace_size * sizeof(struct osprd_trace_event));
+		if (trace_bufs[cpu] == NULL)
+			continue;
+		spin_lock_init(&trace_bufs[cpu]->lock);
+		trace_bufs[cpu]->head = trace_bufs[cpu]->tail = 0;
+		trace_bufs[cpu]->lost = 0;
+	}
+	trace_entry = create_proc_entry("osprdtrace", 0400, NULL);
+	if (trace_entry != NULL)
+		trace_entry->proc_fops = &trace_fops;
+}
+
+static void cleanup_trace(void)
+{
+	int cpu;
+
+	if (trace_entry != NULL)
+		remove_proc_entry("osprdtrace", NULL);
+	for_each_possible_cpu(cpu)
+		if (trace_bufs[cpu] != NULL) {
+			vfree(trace_bufs[cpu]);
+			trace_bufs[cpu] = NULL;
+		}
+}
+
+
+/*
+ * Throttling
+ *   Each throttled process has a bucket per device, which records when its
+ *   byte and call allowances run out: every call pushes those times forward
+ *   by its cost at the process's rates, and the process sleeps off however
+ *   much they end up more than THROTTLE_BURST_USECS ahead of now.  This
+ *   runs in read() and write(), in the process's own context, so it can
+ *   sleep and always charges the right process.
+ */
+
+#define THROTTLE_BURST_USECS	100000		// How far ahead a process
+						// may run
+#define THROTTLE_IDLE_USECS	10000000	// Buckets under the default
+						// limits idle this long are
+						// freed
+
+/* Find the bucket of process 'tgid' on d.  If 'create' is set and a limit
+ * applies to the process, make one if there isn't one yet.  Buckets under
+ * the default limits that have been idle a while are freed on the way.
+ * Precondition: d->mutex is held. */
+static struct throttleBucket* find_bucket(osprd_info_t *d, pid_t tgid,
+					  int create)
+{
+	unsigned long long now = now_usecs();
+	struct throttleBucket** pos = &(d->buckets);
+	struct throttleBucket* b;
+
+	while ((b = *pos) != NULL) {
+		if (b->tgid == tgid)
+			return b;
+		if (!b->explicit && b->bytesTat + THROTTLE_IDLE_USECS < now
+		    && b->iosTat + THROTTLE_IDLE_USECS < now) {
+			*pos = b->next;
+			kfree(b);
+		} else
+			pos = &(b->next);
+	}
+
+	if (!create || (d->throttleBps == 0 && d->throttleIops == 0))
+		return NULL;
+	b = kzalloc(sizeof(struct throttleBucket), GFP_ATOMIC);
+	if (b != NULL) {
+		b->tgid = tgid;
+		b->next = d->buckets;
+		d->buckets = b;
+	}
+	return b;
+}
+
+/* Push allowance *tat forward by 'cost' usecs from 'now', and return how
+ * long the caller must sleep for it. */
+static unsigned long long throttle_charge(unsigned long long *tat,
+					  unsigned long long now,
+					  unsigned long long cost)
+{
+	if (*tat < now)
+		*tat = now;
+	*tat += cost;
+	if (*tat > now + THROTTLE_BURST_USECS)
+		return *tat - now - THROTTLE_BURST_USECS;
+	return 0;
+}
+
+/* Charge the current process for a read() or write() of 'bytes' on d, and
+ * sleep if it is over its limits.  Returns 0, or -ERESTARTSYS if a signal
+ * cut the sleep short. */
+static int throttle_io(osprd_info_t *d, size_t bytes)
+{
+	struct throttleBucket* b;
+	unsigned long long now, cost, wait = 0;
+	unsigned bps, iops;
+
+	if (d->throttleBps == 0 && d->throttleIops == 0
+	    && d->throttleExplicit == 0)
+		return 0;
+
+	osp_spin_lock(&(d->mutex));
+	b = find_bucket(d, current->tgid, 1);
+	if (b == NULL) {
+		osp_spin_unlock(&(d->mutex));
+		return 0;
+	}
+	bps = b->explicit ? b->bps : d->throttleBps;
+	iops = b->explicit ? b->iops : d->throttleIops;
+	now = now_usecs();
+	if (bps != 0) {
+		cost = (unsigned long long) bytes * 1000000;
+		do_div(cost, bps);
+		wait = throttle_charge(&(b->bytesTat), now, cost);
+	}
+	if (iops != 0) {
+		cost = 1000000 / iops;
+		wait = max(wait, throttle_charge(&(b->iosTat), now, cost));
+	}
+	if (wait != 0) {
+		b->throttled++;
+		b->delayUsecs += wait;
+		d->throttled++;
+		d->throttleUsecs += wait;
+	}
+	osp_spin_unlock(&(d->mutex));
+
+	if (wait == 0)
+		return 0;
+	wait += 999;
+	do_div(wait, 1000);
+	schedule_timeout_interruptible(msecs_to_jiffies(wait));
+	return signal_pending(current) ? -ERESTARTSYS : 0;
+}
+
+/* OSPRDIOCTHROTTLE: set the limits in *t.  Returns 0, -EINVAL, or -ENOMEM. */
+static int set_throttle(osprd_info_t *d, struct osprd_throttle *t)
+{
+	struct throttleBucket* b;
+	int limited = t->bytes_per_sec != 0 || t->iops != 0;
+
+	if (t->pid < 0)
+		return -EINVAL;
+
+	osp_spin_lock(&(d->mutex));
+	if (t->pid == 0) {
+		d->throttleBps = t->bytes_per_sec;
+		d->throttleIops = t->iops;
+		osp_spin_unlock(&(d->mutex));
+		return 0;
+	}
+	b = find_bucket(d, t->pid, 0);
+	if (b == NULL && limited) {
+		b = kzalloc(sizeof(struct throttleBucket), GFP_ATOMIC);
+		if (b == NULL) {
+			osp_spin_unlock(&(d->mutex));
+			return -ENOMEM;
+		}
+		b->tgid = t->pid;
+		b->next = d->buckets;
+		d->buckets = b;
+	}
+	if (b != NULL) {
+		if (limited && !b->explicit)
+			d->throttleExplicit++;
+		else if (!limited && b->explicit)
+			d->throttleExplicit--;
+		b->explicit = limited;
+		b->bps = t->bytes_per_sec;
+		b->iops = t->iops;
+	}
+	osp_spin_unlock(&(d->mutex));
+	return 0;
+}
+
+/* OSPRDIOCTHROTTLESTAT: fill in *t for process t->pid. */
+static void get_throttle(osprd_info_t *d, struct osprd_throttle *t)
+{
+	struct throttleBucket* b;
+
+	osp_spin_lock(&(d->mutex));
+	b = t->pid > 0 ? find_bucket(d, t->pid, 0) : NULL;
+	if (b != NULL && b->explicit) {
+		t->bytes_per_sec = b->bps;
+		t->iops = b->iops;
+	} else {
+		t->bytes_per_sec = d->throttleBps;
+		t->iops = d->throttleIops;
+	}
+	if (t->pid <= 0) {
+		t->throttled = d->throttled;
+		t->delay_usecs = d->throttleUsecs;
+	} else {
+		t->throttled = b ? b->throttled : 0;
+		t->delay_usecs = b ? b->delayUsecs : 0;
+	}
+	osp_spin_unlock(&(d->mutex));
+}
+
+
+/* Notify processes that requested change notifications of a write
+ * starting at 'sector' by process 'writer'. */
+static void notify_writers(osprd_info_t *d, unsigned long sector,
+			   pid_t writer)
+{
+	struct pidNode* cur;
+	struct process* p;
+	unsigned long sect;
+
+	if (d->notifProcs == NULL)
+		return;
+	osp_spin_lock(&(d->mutex));
+	cur = d->notifProcs->head;
+	p = isInPidList(d->writeProcs, writer);
+	if (p == NULL)
+		p = isInPidList(d->writeNlkProcs, writer);
+	/* Written-back pages may reach us from a flusher thread rather than
+	 * the writer; go by the write's own sector then. */
+	sect = p != NULL ? p->sect : sector;
+	while (cur != NULL) {
+		cur->proc->reqNotif = 0;
+		/* Set the sector of the disk that was changed. */
+		if (sect < 32)
+			cur->proc->sectors[sect] = 1;
+		cur = cur->next;
+	}
+	osp_spin_unlock(&(d->mutex));
+//	wake_up_all(&(d->blockq));
+}
+
+
+/*
+ * Parallel copy
+ *   A request of at least parallel_copy_kb kilobytes is taken off the queue
+ *   whole and cut into contiguous byte ranges, one per copy worker: a
+ *   kernel thread bound to each online CPU.  The workers copy without
+ *   holding qlock, and the last one to finish completes the request.  The
+ *   request function goes on to the next request meanwhile.
+ *   Each worker also checksums its own range.  Large bios for the striped
+ *   device are cut up the same way, each worker copying its range through
+ *   stripe_transfer(), and OSPRDIOCSCRUB uses the workers to check a whole
+ *   disk.
+ */
+
+#define PARALLEL_MIN_CHUNK	(64 * 1024)	// Smallest range worth a CPU
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+#define osprd_for_each_bio(bio, req)	rq_for_each_bio(bio, req)
+#else
+#define osprd_for_each_bio(bio, req)	__rq_for_each_bio(bio, req)
+#endif
+
+struct bigCopy;
+
+static int stripe_transfer(osprd_stripe_t *st, unsigned long sector,
+			   unsigned nsect, char *buf, int dir, int nt);
+
+/* One worker's share of a request. */
+struct copyChunk {
+	struct bigCopy* bc;
+	unsigned long start;		// First byte, from the request's start
+	unsigned long len;		// Number of bytes
+	struct list_head list;		// In the worker's queue
+};
+
+/* What a bigCopy is doing. */
+#define BIG_REQUEST	0		// Copying 'req' to or from 'd'
+#define BIG_STRIPE	1		// Copying 'bio' to or from 'st'
+#define BIG_SCRUB	2		// Checking the checksums of 'd'
+
+/* Work being spread over the copy workers. */
+struct bigCopy {
+	int kind;			// BIG_*
+	osprd_info_t* d;
+	struct request* req;
+	osprd_stripe_t* st;		// Stripe: the striped device
+	struct bio* bio;		// Stripe: the bio being copied
+	struct osprd_scrub* scrub;	// Scrub: results so far, under qlock
+	struct completion done;		// Scrub: completed by the last chunk
+	unsigned long sector;		// First sector of the request or bio
+	unsigned nsect;			// Number of sectors
+	int write;			// 1: write request, 0: read request
+	int nt;				// Write with non-temporal stores
+	int error;			// Set if a sector failed verify_read()
+	pid_t writer;			// Write: the submitter
+	struct list_head writes;	// Write: in d->bigWrites
+	atomic_t pending;		// Chunks not yet copied
+	struct copyChunk chunks[0];
+};
+
+struct copyWorker {
+	struct task_struct* task;
+	int cpu;			// CPU the worker is bound to
+	spinlock_t lock;		// Protects 'chunks'
+	struct list_head chunks;	// Chunks waiting to be copied
+	wait_queue_head_t wq;
+};
+
+static struct copyWorker copy_workers[NR_CPUS];
+static int ncopy_workers;
+
+/* Returns nonzero if a parallel write on d is still copying 'sector'.
+ * Precondition: d->qlock is held. */
+static int in_big_write(osprd_info_t *d, unsigned long sector)
+{
+	struct bigCopy *bc;
+
+	list_for_each_entry(bc, &d->bigWrites, writes)
+		if (sector >= bc->sector && sector < bc->sector + bc->nsect)
+			return 1;
+	return 0;
+}
+
+/* Check the sectors of chunk c of a scrub against their checksums. */
+static void scrub_chunk(struct copyChunk *c)
+{
+	osprd_info_t *d = c->bc->d;
+	struct osprd_scrub *r = c->bc->scrub;
+	unsigned long sector = c->start / SECTOR_SIZE;
+	unsigned long end = (c->start + c->len) / SECTOR_SIZE, n;
+
+	while (sector < end) {
+		n = bad_sector(d, sector, min(end - sector, 1024UL));
+		if (n - sector == 1024 || n == end) {
+			sector = n;
+			cond_resched();
+			continue;
+		}
+		/* Look again under qlock, in case a write was halfway
+		 * through the sector. */
+		spin_lock_irq(&d->qlock);
+		if (bad_sector(d, n, 1) == n && !in_big_write(d, n)) {
+			if (r->nbad < OSPRD_SCRUB_MAXBAD)
+				r->bad[r->nbad] = n;
+			r->nbad++;
+		}
+		spin_unlock_irq(&d->qlock);
+		sector = n + 1;
+	}
+}
+
+/* Copy chunk c of a bio between its pages and the striped device. */
+static void copy_stripe_chunk(struct copyChunk *c)
+{
+	struct bigCopy *bc = c->bc;
+	unsigned long pos = 0, end = c->start + c->len, from, to;
+	struct bio_vec *bvec;
+	char *buf;
+	int i;
+
+	bio_for_each_segment(bvec, bc->bio, i) {
+		from = max(pos, c->start);
+		to = min(pos + bvec->bv_len, end);
+		if (from < to) {
+			buf = __bio_kmap_atomic(bc->bio, i, KM_USER0);
+			if (stripe_transfer(bc->st, bc->sector + from / SECTOR_SIZE,
+					    (to - from) / SECTOR_SIZE,
+					    buf + (from - pos),
+					    bc->write ? WRITE : READ, bc->nt) < 0)
+				bc->error = 1;
+			__bio_kunmap_atomic(buf, KM_USER0);
+		}
+		pos += bvec->bv_len;
+		if (pos >= end)
+			break;
+	}
+}
+
+/* Copy chunk c between the disk and the request's pages, or scrub it.  The
+ * segments are walked from the start, so each chunk finds its own way
+ * in. */
+static void copy_chunk(struct copyChunk *c)
+{
+	struct bigCopy *bc = c->bc;
+	uint8_t *disk;
+	unsigned long pos = 0, end = c->start + c->len, from, to;
+	unsigned long sector, nsect;
+	struct bio_vec *bvec;
+	struct bio *bio;
+	uint8_t *buf;
+	int i;
+
+	if (bc->kind == BIG_SCRUB) {
+		scrub_chunk(c);
+		return;
+	} else if (bc->kind == BIG_STRIPE) {
+		copy_stripe_chunk(c);
+		return;
+	}
+	disk = bc->d->data + bc->sector * SECTOR_SIZE;
+	if (!bc->write && bc->d->crcs && verify_reads) {
+		sector = bc->sector + c->start / SECTOR_SIZE;
+		nsect = c->len / SECTOR_SIZE;
+		/* Only a mismatch needs qlock: look again under it, in case
+		 * a write was halfway through. */
+		if (bad_sector(bc->d, sector, nsect) != sector + nsect) {
+			spin_lock_irq(&bc->d->qlock);
+			if (verify_read(bc->d, sector, nsect) < 0)
+				bc->error = 1;
+			spin_unlock_irq(&bc->d->qlock);
+		}
+	}
+
+	osprd_for_each_bio(bio, bc->req) {
+		bio_for_each_segment(bvec, bio, i) {
+			from = max(pos, c->start);
+			to = min(pos + bvec->bv_len, end);
+			if (from < to) {
+				// The queue bounces highmem pages, so segments
+				// are always mapped.
+				buf = (uint8_t *) page_address(bvec->bv_page)
+					+ bvec->bv_offset + (from - pos);
+				if (bc->write)
+					copy_to_disk(disk + from, buf,
+						     to - from, bc->nt);
+				else
+					memcpy(buf, disk + from, to - from);
+			}
+			pos += bvec->bv_len;
+			if (pos >= end)
+				goto done;
+		}
+	}
+ done:
+	if (bc->write)
+		update_checksums(bc->d, bc->sector + c->start / SECTOR_SIZE,
+				 c->len / SECTOR_SIZE);
+}
+
+/* Called once every chunk of bc has been copied: do the write's
+ * bookkeeping and complete the request or bio.  A scrub's caller is woken
+ * instead. */
+static void finish_big_copy(struct bigCopy *bc)
+{
+	osprd_info_t *d = bc->d;
+
+	if (bc->kind == BIG_SCRUB) {
+		complete(&bc->done);
+		return;
+	} else if (bc->kind == BIG_STRIPE) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+		bio_endio(bc->bio, bc->bio->bi_size, bc->error ? -EIO : 0);
+#else
+		bio_endio(bc->bio, bc->error ? -EIO : 0);
+#endif
+		kfree(bc);
+		return;
+	}
+	spin_lock_irq(&d->qlock);
+	if (bc->write) {
+		note_write(d, bc->sector, bc->nsect,
+			   d->data + bc->sector * SECTOR_SIZE);
+		notify_writers(d, bc->sector, bc->writer);
+		list_del(&bc->writes);
+	}
+	if (!end_that_request_first(bc->req, !bc->error, bc->nsect))
+		end_that_request_last(bc->req, !bc->error);
+	spin_unlock_irq(&d->qlock);
+	if (bc->write)
+		wake_up_all(&d->bigWriteq);
+	kfree(bc);
+}
+
+static int copy_worker(void *data)
+{
+	struct copyWorker *w = (struct copyWorker *) data;
+	struct copyChunk *c;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(w->wq, kthread_should_stop()
+					 || !list_empty(&w->chunks));
+		spin_lock_irq(&w->lock);
+		while (!list_empty(&w->chunks)) {
+			c = list_entry(w->chunks.next, struct copyChunk, list);
+			list_del_init(&c->list);
+			spin_unlock_irq(&w->lock);
+			copy_chunk(c);
+			if (atomic_dec_and_test(&c->bc->pending))
+				finish_big_copy(c->bc);
+			spin_lock_irq(&w->lock);
+		}
+		spin_unlock_irq(&w->lock);
+	}
+	return 0;
+}
+
+/* Cut the 'bytes' bytes of bc into n sector-aligned ranges, the last one
+ * taking the remainder, and queue one on each of n workers; with node >= 0,
+ * only workers on that node. */
+static void hand_out_chunks(struct bigCopy *bc, int n, unsigned long bytes,
+			    int node)
+{
+	unsigned long per = (bytes / n) & ~(unsigned long) (SECTOR_SIZE - 1);
+	unsigned long flags;
+	struct copyWorker *w;
+	int i;
+
+	for (i = 0, w = copy_workers; i < n; i++, w++) {
+		while (node >= 0 && cpu_to_node(w->cpu) != node)
+			w++;
+		bc->chunks[i].bc = bc;
+		bc->chunks[i].start = i * per;
+		bc->chunks[i].len = i == n - 1 ? bytes - i * per : per;
+		spin_lock_irqsave(&w->lock, flags);
+		list_add_tail(&bc->chunks[i].list, &w->chunks);
+		spin_unlock_irqrestore(&w->lock, flags);
+		wake_up(&w->wq);
+	}
+}
+
+/* Hand request 'req' to the copy workers if it is big enough and there is
+ * more than one of them.  Returns 1 if they took it; otherwise, including
+ * when memory is short, the caller copies it as usual.
+ * Precondition: d->qlock is held (we are in the request function). */
+static int parallel_copy(osprd_info_t *d, struct request *req)
+{
+	unsigned long bytes = req->nr_sectors * SECTOR_SIZE;
+	struct bigCopy *bc;
+	int n, i, nworkers = 0, node = d->node;
+
+	if (parallel_copy_kb <= 0 || ncopy_workers < 2
+	    || bytes < (unsigned long) parallel_copy_kb * 1024)
+		return 0;
+	/* A disk bound to a node is copied by that node's CPUs, if it has
+	 * more than one. */
+	if (node >= 0)
+		for (i = 0; i < ncopy_workers; i++)
+			if (cpu_to_node(copy_workers[i].cpu) == node)
+				nworkers++;
+	if (nworkers < 2) {
+		node = NUMA_ANY;
+		nworkers = ncopy_workers;
+	}
+	n = min_t(unsigned long, nworkers, bytes / PARALLEL_MIN_CHUNK);
+	if (n < 2)
+		return 0;
+	bc = kmalloc(sizeof(struct bigCopy) + n * sizeof(struct copyChunk),
+		     GFP_ATOMIC);
+	if (bc == NULL)
+		return 0;
+
+	bc->kind = BIG_REQUEST;
+	bc->d = d;
+	bc->req = req;
+	bc->error = 0;
+	bc->sector = req->sector;
+	bc->nsect = req->nr_sectors;
+	bc->write = rq_data_dir(req) == WRITE;
+	bc->nt = bc->write && use_nt_copy(bytes) && !reads_back(d);
+	atomic_set(&bc->pending, n);
+	if (trace)
+		trace_event(d, OSPRD_TRACE_REQUEST, bc->write, 0, bc->sector,
+			    bc->nsect);
+	blkdev_dequeue_request(req);
+
+	/* Writes: save what snapshots need before any worker overwrites it,
+	 * and remember the submitter, to be notified for once the data is
+	 * all there.  Until then the write is listed in d->bigWrites. */
+	if (bc->write) {
+		if (d->snapshots != NULL)
+			snapshot_preserve(d, bc->sector, bc->nsect);
+		bc->writer = current->pid;
+		list_add(&bc->writes, &d->bigWrites);
+	}
+
+	hand_out_chunks(bc, n, bytes, node);
+	return 1;
+}
+
+/* Hand bio, a large I/O to the striped device, to the copy workers, like
+ * parallel_copy().  Returns 1 if they took it. */
+static int stripe_parallel(osprd_stripe_t *st, struct bio *bio)
+{
+	unsigned long bytes = bio->bi_size;
+	struct bigCopy *bc;
+	int n;
+
+	if (parallel_copy_kb <= 0 || ncopy_workers < 2
+	    || bytes < (unsigned long) parallel_copy_kb * 1024)
+		return 0;
+	n = min_t(unsigned long, ncopy_workers, bytes / PARALLEL_MIN_CHUNK);
+	if (n < 2)
+		return 0;
+	bc = kmalloc(sizeof(struct bigCopy) + n * sizeof(struct copyChunk),
+		     GFP_NOIO);
+	if (bc == NULL)
+		return 0;
+
+	bc->kind = BIG_STRIPE;
+	bc->d = NULL;
+	bc->req = NULL;
+	bc->st = st;
+	bc->bio = bio;
+	bc->error = 0;
+	bc->sector = bio->bi_sector;
+	bc->nsect = bio_sectors(bio);
+	bc->write = bio_data_dir(bio) == WRITE;
+	bc->nt = bc->write && use_nt_copy(bytes);
+	atomic_set(&bc->pending, n);
+	hand_out_chunks(bc, n, bytes, NUMA_ANY);
+	return 1;
+}
+
+/* Start a copy worker on each online CPU.  With fewer than two, large
+ * requests are simply copied by the request function. */
+static void setup_copy_workers(void)
+{
+	struct copyWorker *w;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		w = &copy_workers[ncopy_workers];
+		spin_lock_init(&w->lock);
+		INIT_LIST_HEAD(&w->chunks);
+		init_waitqueue_head(&w->wq);
+		w->task = kthread_create(copy_worker, w, "osprdcopy/%d", cpu);
+		if (IS_ERR(w->task))
+			continue;
+		kthread_bind(w->task, cpu);
+		w->cpu = cpu;
+		wake_up_process(w->task);
+		ncopy_workers++;
+	}
+}
+
+static void cleanup_copy_workers(void)
+{
+	while (ncopy_workers > 0)
+		kthread_stop(copy_workers[--ncopy_workers].task);
+}
+
+static int compare_sectors(const void *a, const void *b)
+{
+	unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* OSPRDIOCSCRUB: check every sector of d against its checksum, a range per
+ * copy worker, and fill in *r.  Sleeps until they are done. */
+static int scrub_device(osprd_info_t *d, struct osprd_scrub *r)
+{
+	unsigned long bytes = d->nsectors * SECTOR_SIZE, per;
+	struct bigCopy *bc;
+	struct copyWorker *w;
+	int n, i;
+
+	if (!d->crcs)
+		return -EINVAL;
+	n = min_t(unsigned long, max(ncopy_workers, 1), d->nsectors);
+	bc = kmalloc(sizeof(struct bigCopy) + n * sizeof(struct copyChunk),
+		     GFP_KERNEL);
+	if (bc == NULL)
+		return -ENOMEM;
+
+	memset(r, 0, sizeof(*r));
+	bc->kind = BIG_SCRUB;
+	bc->d = d;
+	bc->req = NULL;
+	bc->sector = 0;
+	bc->nsect = d->nsectors;
+	bc->scrub = r;
+	init_completion(&bc->done);
+	atomic_set(&bc->pending, n);
+	per = (bytes / n) & ~(unsigned long) (SECTOR_SIZE - 1);
+	for (i = 0; i < n; i++) {
+		bc->chunks[i].bc = bc;
+		bc->chunks[i].start = i * per;
+		bc->chunks[i].len = i == n - 1 ? bytes - i * per : per;
+	}
+
+	if (ncopy_workers == 0)
+		scrub_chunk(&bc->chunks[0]);
+	else {
+		for (i = 0, w = copy_workers; i < n; i++, w++) {
+			spin_lock_irq(&w->lock);
+			list_add_tail(&bc->chunks[i].list, &w->chunks);
+			spin_unlock_irq(&w->lock);
+			wake_up(&w->wq);
+		}
+		wait_for_completion(&bc->done);
+	}
+	kfree(bc);
+
+	r->checked = d->nsectors;
+	sort(r->bad, min_t(unsigned, r->nbad, OSPRD_SCRUB_MAXBAD),
+	     sizeof(unsigned), compare_sectors, NULL);
+	return 0;
+}
+
+
+/*
+ * osprd_process_request(d, req)
+ *   Called when the user reads or writes a sector.
+ *   Should perform the read or write, as appropriate.
+ */
+static void osprd_process_request(osprd_info_t *d, struct request *req)
+{
+	uint8_t* dPtr;
+	unsigned int reqType;
+
+	if (!blk_fs_request(req)) {
+		end_request(req, 0);
+		return;
+	}
+
+	/* Large requests are copied by several CPUs at once. */
+	if (parallel_copy(d, req))
+		return;
+
+	/* Otherwise the request comes back for each segment, and is traced
+	 * a segment at a time. */
+	if (trace)
+		trace_event(d, OSPRD_TRACE_REQUEST, rq_data_dir(req) == WRITE,
+			    0, req->sector, req->current_nr_sectors);
+
+	// EXERCISE: Perform the read or write request by copying data between
+	// our data array and the request's buffer.
+	// Hint: The 'struct request' argument tells you what kind of request
+	// this is, and which sectors are being read or written.
+	// Read about 'struct request' in <linux/blkdev.h>.
+	// Consider the 'req->sector', 'req->current_nr_sectors', and
+	// 'req->buffer' members, and the rq_data_dir() function.
+
+	// Your code here.
+	
+	/* Get pointer to data on disk requested by the user.
+	 * req->sector: sector specified by the user to read/write to.
+	 * (req->sector * SECTOR_SIZE): offset */
+	dPtr = d->data + ((req->sector) * SECTOR_SIZE);
+        /* Determine whether the request is a read or a write.
+         * READ: 0, WRITE: 1 (defined in <linux/fs.h>) */
+	reqType = rq_data_dir(req);
+	/* req->current_nr_sectors: number of sectors to read/write to. */
+	if (reqType == READ) {
+		/* Fail the read if the data has been corrupted. */
+		if (verify_read(d, req->sector, req->current_nr_sectors) < 0) {
+			end_request(req, 0);
+			return;
+		}
+		/* Copy contents of data buffer into request's buffer. */
+		memcpy((void*) req->buffer, (void*) dPtr, 
+			req->current_nr_sectors * SECTOR_SIZE);
+	}
+	else { // reqType == WRITE
+		/* Copy contents of request's buffer into data buffer,
+		 * saving the old contents for snapshots. */
+		store_sectors(d, req->sector, req->current_nr_sectors,
+			      (uint8_t*) req->buffer,
+			      use_nt_copy(req->nr_sectors * SECTOR_SIZE));
+		notify_writers(d, req->sector, current->pid);
+	}
+
+	end_request(req, 1);
+}
+
+
+
+/*
+ * Inline completion
+ *   The queue's make_request function, which hands each bio to the
+ *   elevator, is wrapped by osprd_make_request.  A small bio is copied on
+ *   the spot and ended before the submitter returns, so it never waits for
+ *   the queue to be unplugged or for the request function; everything else
+ *   goes on to the queue as before.
+ */
+
+static make_request_fn *queue_make_request;	// What blk_init_queue set
+
+static int osprd_make_request(request_queue_t *q, struct bio *bio)
+{
+	osprd_info_t *d = (osprd_info_t *) q->queuedata;
+	unsigned long sector = bio->bi_sector;
+	unsigned int size = bio->bi_size;
+	int write = bio_data_dir(bio) == WRITE;
+	struct bio_vec *bvec;
+	char *buf;
+	int i, err = 0;
+
+	/* Barriers need the queue to order them; cache mode has its own
+	 * thread. */
+	if (inline_kb <= 0 || size > (unsigned) inline_kb * 1024
+	    || bio_barrier(bio) || d->backing
+	    || sector + bio_sectors(bio) > d->nsectors)
+		return queue_make_request(q, bio);
+
+	spin_lock_irq(&d->qlock);
+	if (trace)
+		trace_event(d, OSPRD_TRACE_REQUEST, write, 0, sector,
+			    bio_sectors(bio));
+	bio_for_each_segment(bvec, bio, i) {
+		buf = __bio_kmap_atomic(bio, i, KM_USER0);
+		if (write)
+			store_sectors(d, sector, bvec->bv_len / SECTOR_SIZE,
+				      (uint8_t *) buf, 0);
+		else if (verify_read(d, sector, bvec->bv_len / SECTOR_SIZE) < 0)
+			err = -EIO;
+		else
+			memcpy(buf, d->data + sector * SECTOR_SIZE,
+			       bvec->bv_len);
+		__bio_kunmap_atomic(buf, KM_USER0);
+		sector += bvec->bv_len / SECTOR_SIZE;
+	}
+	spin_unlock_irq(&d->qlock);
+	if (write)
+		notify_writers(d, bio->bi_sector, current->pid);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+	bio_endio(bio, size, err);
+#else
+	(void) size;
+	bio_endio(bio, err);
+#endif
+	return 0;
+}
+
+
+/*
+ * Striping
+ *   Sector 'sector' of the striped device is in chunk sector / chunk, and
+ *   chunk c lives on member c % nmembers, as that member's chunk
+ *   c / nmembers.
+ */
+
+/* Read or write 'nsect' sectors of the striped device starting at 'sector',
+ * one chunk at a time, to or from 'buf'.  Writes pass 'nt' on to
+ * store_sectors().  Returns 0, or -EIO if a read fails verify_read(). */
+static int stripe_transfer(osprd_stripe_t *st, unsigned long sector,
+			   unsigned nsect, char *buf, int dir, int nt)
+{
+	osprd_info_t *d;
+	unsigned long c, msector;
+	unsigned n, off;
+	int r = 0;
+
+	while (nsect > 0) {
+		c = sector / st->chunk;
+		off = sector % st->chunk;
+		d = st->members[c % st->nmembers];
+		msector = (c / st->nmembers) * st->chunk + off;
+		n = min_t(unsigned, nsect, st->chunk - off);
+
+		spin_lock_irq(&d->qlock);
+		if (dir == WRITE)
+			store_sectors(d, msector, n, (uint8_t *) buf, nt);
+		else if (verify_read(d, msector, n) < 0)
+			r = -EIO;
+		else
+			memcpy(buf, d->data + msector * SECTOR_SIZE,
+			       n * SECTOR_SIZE);
+		spin_unlock_irq(&d->qlock);
+
+		sector += n;
+		nsect -= n;
+		buf += n * SECTOR_SIZE;
+	}
+	return r;
+}
+
+/* The striped device has no request queue: the block layer hands each bio
+ * straight to this function, which copies it segment by segment, or hands
+ * it to the copy workers if it is large. */
+static int stripe_make_request(request_queue_t *q, struct bio *bio)
+{
+	osprd_stripe_t *st = (osprd_stripe_t *) q->queuedata;
+	unsigned long sector = bio->bi_sector;
+	unsigned int size = bio->bi_size;
+	struct bio_vec *bvec;
+	int nt = bio_data_dir(bio) == WRITE && use_nt_copy(size);
+	char *buf;
+	int i, err = 0;
+
+	if (bio->bi_sector + bio_sectors(bio) > st->nsectors)
+		err = -EIO;
+	else if (stripe_parallel(st, bio))
+		return 0;
+	else
+		bio_for_each_segment(bvec, bio, i) {
+			buf = __bio_kmap_atomic(bio, i, KM_USER0);
+			if (stripe_transfer(st, sector,
+					    bvec->bv_len / SECTOR_SIZE, buf,
+					    bio_data_dir(bio), nt) < 0)
+				err = -EIO;
+			__bio_kunmap_atomic(buf, KM_USER0);
+			sector += bvec->bv_len / SECTOR_SIZE;
+		}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+	bio_endio(bio, size, err);
+#else
+	(void) size;
+	bio_endio(bio, err);
+#endif
+	return 0;
+}
+
+
+/*
+ * Cache mode
+ *   A disk in cache mode keeps its data in a backing file; 'data' holds up
+ *   to nsectors / CACHE_LINE lines of it.  Reading the backing file may
+ *   sleep, which the request function may not, so it passes requests to the
+ *   device's cache thread.
+ */
+
+#define CACHE_LINE	8		// Sectors per cache line
+#define CACHE_EMPTY	(~0UL)		// Tag of an empty slot
+#define CACHE_BATCH	32		// Most lines written back at once
+#define CACHE_FLUSH_INTERVAL	(5 * HZ)
+
+/* Read or write 'nlines' lines of the backing file, starting with line
+ * 'line', from or to 'buf'.  Returns 0 or -EIO. */
+static int backing_io(osprd_info_t *d, unsigned long line, unsigned nlines,
+		      uint8_t *buf, int dir)
+{
+	loff_t pos = (loff_t) line * CACHE_LINE * SECTOR_SIZE;
+	size_t len = nlines * CACHE_LINE * SECTOR_SIZE;
+	mm_segment_t old_fs = get_fs();
+	ssize_t r;
+
+	set_fs(KERNEL_DS);
+	if (dir == WRITE)
+		r = vfs_write(d->backing, (const char __user *) buf, len, &pos);
+	else
+		r = vfs_read(d->backing, (char __user *) buf, len, &pos);
+	set_fs(old_fs);
+	return r == (ssize_t) len ? 0 : -EIO;
+}
+
+/* Write back dirty lines until at most 'target' are left.  Runs of dirty
+ * slots holding consecutive lines are written with one call, up to
+ * CACHE_BATCH lines at a time.
+ * Precondition: called by d->cacheThread. */
+static void cache_flush(osprd_info_t *d, unsigned target)
+{
+	unsigned long nslots = nsectors / CACHE_LINE;
+	unsigned long slot = 0, line;
+	unsigned n, i;
+
+	while (d->cacheDirtyCount > target) {
+		slot = find_next_bit(d->cacheDirty, nslots, slot);
+		if (slot >= nslots)
+			break;
+		line = d->cacheTag[slot];
+		for (n = 1; n < CACHE_BATCH && slot + n < nslots
+			     && test_bit(slot + n, d->cacheDirty)
+			     && d->cacheTag[slot + n] == line + n; n++)
+			/* do nothing */;
+		if (backing_io(d, line, n, d->data + slot * CACHE_LINE
+			       * SECTOR_SIZE, WRITE) < 0) {
+			eprintk("osprd: write-back of line %lu failed\n", line);
+			break;
+		}
+		for (i = 0; i < n; i++)
+			__clear_bit(slot + i, d->cacheDirty);
+		d->cacheDirtyCount -= n;
+		slot += n;
+	}
+}
+
+/* Return where line 'line' is cached, loading it into its slot first if
+ * necessary.  The line the slot held before is written back if dirty.  If
+ * 'fill' is 0, the caller will overwrite the whole line, so it isn't read.
+ * Returns NULL on an I/O error.
+ * Precondition: called by d->cacheThread. */
+static uint8_t* cache_get_line(osprd_info_t *d, unsigned long line, int fill)
+{
+	unsigned long slot = line % (nsectors / CACHE_LINE);
+	uint8_t *buf = d->data + slot * CACHE_LINE * SECTOR_SIZE;
+
+	if (d->cacheTag[slot] == line)
+		return buf;
+	if (test_bit(slot, d->cacheDirty)) {
+		if (backing_io(d, d->cacheTag[slot], 1, buf, WRITE) < 0)
+			return NULL;
+		__clear_bit(slot, d->cacheDirty);
+		d->cacheDirtyCount--;
+	}
+	d->cacheTag[slot] = CACHE_EMPTY;
+	if (fill && backing_io(d, line, 1, buf, READ) < 0)
+		return NULL;
+	d->cacheTag[slot] = line;
+	return buf;
+}
+
+/* Read or write 'nsect' sectors at 'sector' through the cache.
+ * Returns 0 or -EIO.
+ * Precondition: called by d->cacheThread. */
+static int cache_transfer(osprd_info_t *d, unsigned long sector,
+			  unsigned nsect, char *buf, int dir)
+{
+	unsigned long line, slot;
+	unsigned off, n;
+	uint8_t *lineData;
+
+	while (nsect > 0) {
+		line = sector / CACHE_LINE;
+		off = sector % CACHE_LINE;
+		n = min_t(unsigned, nsect, CACHE_LINE - off);
+		lineData = cache_get_line(d, line,
+					  dir == READ || n < CACHE_LINE);
+		if (lineData == NULL)
+			return -EIO;
+		lineData += off * SECTOR_SIZE;
+
+		if (dir == WRITE) {
+			spin_lock_irq(&d->qlock);
+			memcpy(lineData, buf, n * SECTOR_SIZE);
+			note_write(d, sector, n, lineData);
+			spin_unlock_irq(&d->qlock);
+			slot = line % (nsectors / CACHE_LINE);
+			if (!__test_and_set_bit(slot, d->cacheDirty))
+				d->cacheDirtyCount++;
+		} else
+			memcpy(buf, lineData, n * SECTOR_SIZE);
+
+		sector += n;
+		nsect -= n;
+		buf += n * SECTOR_SIZE;
+	}
+	return 0;
+}
+
+/* Serve a request taken off the queue by osprd_process_request_queue,
+ * one segment at a time. */
+static void cache_process_request(osprd_info_t *d, struct request *req)
+{
+	int uptodate, more;
+
+	do {
+		uptodate = cache_transfer(d, req->sector,
+					  req->current_nr_sectors, req->buffer,
+					  rq_data_dir(req)) == 0;
+		spin_lock_irq(&d->qlock);
+		more = end_that_request_first(req, uptodate,
+					      req->current_nr_sectors);
+		if (!more)
+			end_that_request_last(req, uptodate);
+		spin_unlock_irq(&d->qlock);
+	} while (more);
+}
+
+/* The cache thread serves queued requests.  In between, it writes dirty
+ * lines back: down to half of dirty_ratio when more than dirty_ratio
+ * percent of the cache is dirty, and all of them when it has been idle for
+ * CACHE_FLUSH_INTERVAL.  Everything is written back before it stops. */
+static int cache_thread(void *data)
+{
+	osprd_info_t *d = (osprd_info_t *) data;
+	unsigned long nslots = nsectors / CACHE_LINE;
+	unsigned limit = nslots * dirty_ratio / 100;
+	struct request *req;
+	long r;
+
+	while (!kthread_should_stop()) {
+		r = wait_event_interruptible_timeout(d->cacheq,
+			kthread_should_stop() || !list_empty(&d->cacheReqs),
+			CACHE_FLUSH_INTERVAL);
+
+		spin_lock_irq(&d->qlock);
+		while (!list_empty(&d->cacheReqs)) {
+			req = list_entry(d->cacheReqs.next, struct request,
+					 queuelist);
+			list_del_init(&req->queuelist);
+			spin_unlock_irq(&d->qlock);
+			cache_process_request(d, req);
+			spin_lock_irq(&d->qlock);
+		}
+		spin_unlock_irq(&d->qlock);
+
+		if (r == 0)
+			cache_flush(d, 0);
+		else if (d->cacheDirtyCount > limit)
+			cache_flush(d, limit / 2);
+	}
+
+	cache_flush(d, 0);
+	return 0;
+}
+
+
+// This function is called when a /dev/osprdX file is opened.
+// You aren't likely to need to change this.
+static int osprd_open(struct inode *inode, struct file *filp)
+{
+	osprd_info_t *d = file2osprd(filp);
+
+	// Set the O_SYNC flag unless the device is in write-back mode. That
+	// way, we will get writes immediately instead of waiting for them to
+	// get through write-back caches.
+	if (d == NULL || !writeback[d - osprds])
+		filp->f_flags |= O_SYNC;
+	return 0;
+}
+
+
+/*
+ * osprd_lock
+ *   Helpers implementing the device lock ioctls, and the lock release on
+ *   the last close of a file.
+ */
+
+/* Records that 'task' holds a read or write lock on d.  filp may be NULL
+ * for locks taken through another device's file.
+ * Precondition: d->mutex is held. */
+static void grant_lock_to(osprd_info_t *d, struct file *filp,
+			  struct task_struct *task, int writer)
+{
+	struct process* newProc;
+
+	if (filp != NULL)
+		filp->f_flags |= F_OSPRD_LOCKED; // Claim the lock
+
+	newProc = kzalloc(sizeof(struct process), GFP_ATOMIC);
+	newProc->info = task;
+	newProc->reqNotif = 0;
+	if (writer)
+		addToPidList(&(d->writeProcs), newProc);
+	else
+		addToPidList(&(d->readProcs), newProc);
+}
+
+/* Records that the current process holds a read or write lock on d.
+ * Precondition: d->mutex is held. */
+static void grant_lock(osprd_info_t *d, struct file *filp, int writer)
+{
+	grant_lock_to(d, filp, current, writer);
+}
+
+/* Gives up ticket t without taking the lock, so later tickets aren't stuck
+ * behind it. Precondition: d->mutex is held. */
+static void abandon_ticket(osprd_info_t *d, unsigned t)
+{
+	struct ticketList** queue = ticketQueue(d, t);
+
+	if (queue != NULL)
+		removeFromTicketList(queue, t);
+	if (t == d->ticket_tail)
+		pickNextTicket(d);
+}
+
+/* The class of a lock request that doesn't name one, from the nice value
+ * of the task making it. */
+static int task_lock_class(struct task_struct *task)
+{
+	int nice = task_nice(task);
+	if (nice < 0)
+		return OSPRD_CLASS_HIGH;
+	if (nice > 0)
+		return OSPRD_CLASS_LOW;
+	return OSPRD_CLASS_NORMAL;
+}
+
+/* Phase-fair policy: ends the current write phase.  Every reader that
+ * blocked during the phase is admitted at once, and writers wait until all
+ * of them have entered and left again.
+ * Precondition: d->mutex is held. */
+static void end_write_phase(osprd_info_t *d)
+{
+	d->write_phase = d->write_phase + 1;
+	d->admittedReaders = d->admittedReaders + d->blockedReaders;
+	d->blockedReaders = 0;
+}
+
+/* d->fastlock mirrors every lock granted here as well as the locks user
+ * space takes itself through the mmap()ed page, so both kinds exclude each
+ * other.  User space changes it without taking d->mutex, so it is only
+ * updated with atomic instructions.  Locks taken in user space are also
+ * recorded against the slot of the file they were taken through, and
+ * dropped when that file is closed for the last time. */
+
+/* Returns 1 if a read or write lock could take d's shared lock word now. */
+static int fast_lock_available(osprd_info_t *d, int writer)
+{
+	int state = d->fastlock->state;
+	return writer ? state == 0 : state >= 0;
+}
+
+/* Tries to take d's shared lock word, for the file holding 'slot', or for
+ * an ioctl lock if 'slot' is 0.  Returns 1 on success. */
+static int fast_lock_take(osprd_info_t *d, int writer, int slot)
+{
+	int state = d->fastlock->state;
+	if (writer)
+		return state == 0 && cmpxchg(&(d->fastlock->state), 0,
+			OSPRD_FAST_OWNER(slot)) == 0;
+	if (state < 0 ||
+	    cmpxchg(&(d->fastlock->state), state, state + 1) != state)
+		return 0;
+	if (slot != 0)
+		atomic_inc((atomic_t *) &(d->fastlock->holds[slot]));
+	return 1;
+}
+
+/* Drops d's shared lock word. */
+static void fast_lock_put(osprd_info_t *d, int writer)
+{
+	if (writer) {
+		smp_mb();
+		d->fastlock->state = 0;
+	} else
+		atomic_dec((atomic_t *) &(d->fastlock->state));
+}
+
+/* Returns filp's slot in d's shared lock page, or 0 if it has none.
+ * Precondition: d->mutex is held. */
+static int fast_slot(osprd_info_t *d, struct file *filp)
+{
+	int i;
+
+	for (i = 1; i < OSPRD_FAST_SLOTS; i++)
+		if (d->fastSlots[i] == filp)
+			return i;
+	return 0;
+}
+
+/* Give filp a slot in d's shared lock page, if it has none yet.  Returns
+ * the slot, or -EBUSY if they are all taken. */
+static int give_fast_slot(osprd_info_t *d, struct file *filp)
+{
+	int slot;
+
+	osp_spin_lock(&(d->mutex));
+	slot = fast_slot(d, filp);
+	if (slot == 0) {
+		for (slot = 1; slot < OSPRD_FAST_SLOTS; slot++)
+			if (d->fastSlots[slot] == NULL)
+				break;
+		if (slot == OSPRD_FAST_SLOTS)
+			slot = -EBUSY;
+		else {
+			d->fastSlots[slot] = filp;
+			d->fastlock->holds[slot] = 0;
+		}
+	}
+	osp_spin_unlock(&(d->mutex));
+	return slot;
+}
+
+
+/* Sleeps on d->blockq until 'condition' holds or 'timeout' jiffies pass
+ * (MAX_SCHEDULE_TIMEOUT waits forever).  Evaluates to 0 on success, with
+ * the jiffies left stored back in 'timeout', a variable, so that a later
+ * wait for the same lock gets only what remains; -ERESTARTSYS if awoken by
+ * a signal; or -ETIMEDOUT. */
+#define wait_for_lock(d, condition, timeout)				\
+({									\
+	long __ret = wait_event_interruptible_timeout((d)->blockq,	\
+		condition, timeout);					\
+	if (__ret == 0)							\
+		__ret = -ETIMEDOUT;					\
+	else if (__ret > 0) {						\
+		(timeout) = __ret;					\
+		__ret = 0;						\
+	}								\
+	__ret;								\
+})
+
+/* Takes d's shared lock word for a request the queue has already admitted,
+ * waiting at most 'timeout' jiffies, what is left of the request's wait,
+ * for user-space lock holders to leave.  Returns 0, -ERESTARTSYS or
+ * -ETIMEDOUT.
+ * Precondition: d->mutex is held; it is held again on return. */
+static int take_fast_lock(osprd_info_t *d, int writer, long timeout)
+{
+	int r = 0;
+	while (!fast_lock_take(d, writer, 0)) {
+		/* Tell user space to wake us when it releases the lock. */
+		atomic_inc((atomic_t *) &(d->fastlock->waiters));
+		osp_spin_unlock(&(d->mutex));
+		r = wait_for_lock(d, fast_lock_available(d, writer), timeout);
+		osp_spin_lock(&(d->mutex));
+		atomic_dec((atomic_t *) &(d->fastlock->waiters));
+		if (r != 0)
+			break;
+	}
+	return r;
+}
+
+/* Returns 1 if the writer holding ticket t may take the lock: it must be
+ * its turn and no other process can be reading or writing. */
+static int writer_may_enter(osprd_info_t *d, unsigned t)
+{
+	return t == d->ticket_tail && d->readProcs == NULL &&
+		d->writeProcs == NULL && d->admittedReaders == 0;
+}
+
+/* Returns 1 if the FIFO reader holding ticket t may take the lock: it must
+ * be its turn, no other process can be writing, and no reader can be
+ * waiting to upgrade. */
+static int reader_may_enter(osprd_info_t *d, unsigned t)
+{
+	return t == d->ticket_tail && d->writeProcs == NULL &&
+		d->upgrader == 0;
+}
+
+/* Returns 1 if the holder of ticket t should keep spinning: t is next or
+ * next but one, and the process holding the lock, if any, is on a CPU
+ * right now, so it will probably release the lock soon.  (A TASK_RUNNING
+ * process may just be waiting for a CPU, perhaps ours.)
+ * Precondition: d->mutex is held. */
+static int worth_spinning(osprd_info_t *d, unsigned t)
+{
+	struct pidList* holders = d->writeProcs ? d->writeProcs : d->readProcs;
+
+	if (t - d->ticket_tail > 1)
+		return 0;
+	return holders == NULL || holders->head == NULL ||
+		task_curr(holders->head->proc->info);
+}
+
+/* Spin for at most spin_usecs microseconds until may_enter(d, t), giving
+ * up early once spinning stops being worthwhile.  Sleeping and being woken
+ * costs more than a short lock hold time, but spinning is only a win when
+ * the holder is running on another CPU.  Returns 1 if may_enter(d, t).
+ * Precondition: d->mutex is not held. */
+static int spin_for_lock(osprd_info_t *d, unsigned t,
+			 int (*may_enter)(osprd_info_t *, unsigned))
+{
+	int i, worth = 1;
+
+	if (num_online_cpus() < 2)
+		return 0;
+	for (i = 0; i < spin_usecs && worth; i++) {
+		if (may_enter(d, t))
+			return 1;
+		if (i % 16 == 0) {
+			osp_spin_lock(&(d->mutex));
+			worth = worth_spinning(d, t);
+			osp_spin_unlock(&(d->mutex));
+		}
+		udelay(1);
+	}
+	return may_enter(d, t);
+}
+
+/* Returns 1 if the queued asynchronous request req may be granted, apart
+ * from the shared lock word.  Phase-fair readers are admitted, like
+ * blocked readers in acquire_phasefair_read, once their write phase ends.
+ * Precondition: d->mutex is held. */
+static int async_request_ready(osprd_info_t *d, struct asyncReq *req)
+{
+	if (!req->writer && d->lock_policy == OSPRD_POLICY_PHASEFAIR) {
+		if (!req->admitted && req->phase != d->write_phase) {
+			req->admitted = 1;
+			d->admittedReaders = d->admittedReaders - 1;
+		}
+		return req->admitted;
+	}
+	if (req->writer)
+		return writer_may_enter(d, req->ticket);
+	return reader_may_enter(d, req->ticket);
+}
+
+/* Grants every queued asynchronous request that can proceed.  A grant may
+ * advance ticket_tail and let a later request through, so scan until
+ * nothing changes.  Pollers are woken by the caller.
+ * Precondition: d->mutex is held. */
+static void grant_async_requests(osprd_info_t *d)
+{
+	struct asyncReq** pos;
+	struct asyncReq* req;
+	int granted = 1;
+
+	while (granted) {
+		granted = 0;
+		pos = &(d->asyncReqs);
+		while (*pos != NULL) {
+			req = *pos;
+			if (!async_request_ready(d, req) ||
+				!fast_lock_take(d, req->writer, 0)) {
+				pos = &(req->next);
+				continue;
+			}
+			*pos = req->next;
+			if (req->writer)
+				d->writersWaiting = d->writersWaiting - 1;
+			if (req->writer ||
+				d->lock_policy == OSPRD_POLICY_FIFO)
+				incrementTicket(d, req->ticket);
+			grant_lock_to(d, req->filp, req->task, req->writer);
+			atomic_dec((atomic_t *) &(d->fastlock->waiters));
+			kfree(req);
+			granted = 1;
+		}
+	}
+}
+
+/* Grants queued asynchronous requests that can now proceed, then wakes up
+ * every process blocked on d->blockq or polling for a grant.
+ * Precondition: d->mutex is not held. */
+static void wake_lock_waiters(osprd_info_t *d)
+{
+	osp_spin_lock(&(d->mutex));
+	grant_async_requests(d);
+	osp_spin_unlock(&(d->mutex));
+	wake_up_all(&(d->blockq));
+}
+
+/* Returns the asynchronous request pending on filp, or NULL.
+ * Precondition: d->mutex is held. */
+static struct asyncReq* find_async_request(osprd_info_t *d, struct file *filp)
+{
+	struct asyncReq* req;
+	for (req = d->asyncReqs; req != NULL; req = req->next)
+		if (req->filp == filp)
+			return req;
+	return NULL;
+}
+
+/* Queue a lock request on d without blocking.  Returns 0 if the lock was
+ * granted at once, -EINPROGRESS if it was queued (poll() reports the file
+ * readable once it is granted), -EDEADLK if the process already holds a
+ * lock on d, or -EBUSY if a request is already pending on filp. */
+static int enqueue_lock(osprd_info_t *d, struct file *filp, int writer)
+{
+	struct asyncReq* req;
+	struct asyncReq** pos;
+	int r;
+
+	osp_spin_lock(&(d->mutex));
+	if (isInPidList(d->writeProcs, current->pid) ||
+		isInPidList(d->readProcs, current->pid)) {
+		osp_spin_unlock(&(d->mutex));
+		return -EDEADLK;
+	}
+	if (find_async_request(d, filp) != NULL) {
+		osp_spin_unlock(&(d->mutex));
+		return -EBUSY;
+	}
+
+	req = kzalloc(sizeof(struct asyncReq), GFP_ATOMIC);
+	req->filp = filp;
+	req->task = current;
+	req->writer = writer;
+	if (!writer && d->lock_policy == OSPRD_POLICY_PHASEFAIR) {
+		req->phase = d->write_phase;
+		req->admitted = d->writeProcs == NULL &&
+			d->writersWaiting == 0;
+		if (!req->admitted)
+			d->blockedReaders = d->blockedReaders + 1;
+	} else {
+		req->ticket = takeTicket(d, task_lock_class(current));
+		if (writer)
+			d->writersWaiting = d->writersWaiting + 1;
+	}
+	/* Pending requests count as sleepers on the shared lock word, so
+	 * user-space releases report to the kernel. */
+	atomic_inc((atomic_t *) &(d->fastlock->waiters));
+
+	/* Append, so requests are scanned in arrival order. */
+	for (pos = &(d->asyncReqs); *pos != NULL; pos = &((*pos)->next))
+		/* do nothing */;
+	*pos = req;
+
+	grant_async_requests(d);
+	r = find_async_request(d, filp) == NULL ? 0 : -EINPROGRESS;
+	osp_spin_unlock(&(d->mutex));
+	if (r == 0)
+		wake_lock_waiters(d);
+	return r;
+}
+
+/* Cancel the asynchronous request pending on filp, giving up its place in
+ * the queue.  Returns 0, or -EINVAL if no request is pending (it may
+ * already have been granted; release it with OSPRDIOCRELEASE). */
+static int cancel_async_request(osprd_info_t *d, struct file *filp)
+{
+	struct asyncReq** pos;
+	struct asyncReq* req;
+
+	osp_spin_lock(&(d->mutex));
+	for (pos = &(d->asyncReqs); *pos != NULL; pos = &((*pos)->next))
+		if ((*pos)->filp == filp)
+			break;
+	if (*pos == NULL) {
+		osp_spin_unlock(&(d->mutex));
+		return -EINVAL;
+	}
+	req = *pos;
+	*pos = req->next;
+
+	if (!req->writer && d->lock_policy == OSPRD_POLICY_PHASEFAIR) {
+		if (!req->admitted && req->phase == d->write_phase)
+			d->blockedReaders = d->blockedReaders - 1;
+		else if (!req->admitted)
+			d->admittedReaders = d->admittedReaders - 1;
+	} else {
+		abandon_ticket(d, req->ticket);
+		if (req->writer) {
+			d->writersWaiting = d->writersWaiting - 1;
+			if (d->lock_policy == OSPRD_POLICY_PHASEFAIR &&
+				d->writersWaiting == 0 &&
+				d->writeProcs == NULL)
+				end_write_phase(d);
+		}
+	}
+	atomic_dec((atomic_t *) &(d->fastlock->waiters));
+	kfree(req);
+	osp_spin_unlock(&(d->mutex));
+	wake_lock_waiters(d);
+	return 0;
+}
+
+/* Phase-fair policy: acquire a read lock.  Readers don't take tickets;
+ * they enter immediately unless a writer holds or waits for the lock, and
+ * otherwise wait for the current write phase to end. */
+static int acquire_phasefair_read(osprd_info_t *d, struct file *filp,
+				  long timeout)
+{
+	unsigned phase;
+	int r;
+
+	if (d->writeProcs == NULL && d->writersWaiting == 0)
+		goto enter;
+
+	phase = d->write_phase;
+	d->blockedReaders = d->blockedReaders + 1;
+	osp_spin_unlock(&(d->mutex));
+
+	r = wait_for_lock(d, d->write_phase != phase, timeout);
+
+	osp_spin_lock(&(d->mutex));
+	if (d->write_phase == phase)
+		d->blockedReaders = d->blockedReaders - 1;
+	else
+		d->admittedReaders = d->admittedReaders - 1;
+	if (r != 0 || d->write_phase == phase) {
+		osp_spin_unlock(&(d->mutex));
+		/* A writer may have been waiting for this reader to enter. */
+		wake_lock_waiters(d);
+		return r != 0 ? r : -ERESTARTSYS;
+	}
+
+ enter:
+	r = take_fast_lock(d, 0, timeout);
+	if (r == 0)
+		grant_lock(d, filp, 0);
+	osp_spin_unlock(&(d->mutex));
+	if (r != 0)
+		wake_lock_waiters(d);
+	return r;
+}
+
+/* Join d's queue and block on d->blockq until the lock is granted or
+ * 'timeout' jiffies pass (MAX_SCHEDULE_TIMEOUT waits forever).  Returns 0,
+ * -ERESTARTSYS if awoken by a signal, or -ETIMEDOUT.
+ * Precondition: d->mutex is held; it is released on return. */
+static int queue_for_lock(osprd_info_t *d, struct file *filp, int writer,
+			  int cls, long timeout)
+{
+	int (*may_enter)(osprd_info_t *, unsigned) =
+		writer ? writer_may_enter : reader_may_enter;
+	unsigned curTicket;
+	int r = 0, spun;
+
+	if (!writer && d->lock_policy == OSPRD_POLICY_PHASEFAIR)
+		return acquire_phasefair_read(d, filp, timeout);
+
+	/* Current process gets a ticket from ticket_head. */
+	curTicket = takeTicket(d, cls);
+	if (writer)
+		d->writersWaiting = d->writersWaiting + 1;
+	osp_spin_unlock(&(d->mutex));
+
+	/* Spin briefly if the lock is about to come free; sleep otherwise. */
+	spun = spin_for_lock(d, curTicket, may_enter);
+	while (1) {
+		if (!spun)
+			r = wait_for_lock(d, may_enter(d, curTicket), timeout);
+		osp_spin_lock(&(d->mutex));
+		/* A more urgent ticket may have taken our turn since the
+		 * condition was checked. */
+		if (r != 0 || may_enter(d, curTicket))
+			break;
+		osp_spin_unlock(&(d->mutex));
+		spun = 0;
+	}
+
+	if (r == 0 && spun)
+		d->spinAcquires = d->spinAcquires + 1;
+	else if (r == 0)
+		d->sleepAcquires = d->sleepAcquires + 1;
+	if (r == 0)
+		r = take_fast_lock(d, writer, timeout);
+	if (writer)
+		d->writersWaiting = d->writersWaiting - 1;
+
+	if (r != 0) {
+		/* Awoken by a signal or timed out: give the ticket up.  If
+		 * this was the last writer readers were waiting for, let them
+		 * in. */
+		abandon_ticket(d, curTicket);
+		if (writer && d->lock_policy == OSPRD_POLICY_PHASEFAIR &&
+			d->writersWaiting == 0 && d->writeProcs == NULL)
+			end_write_phase(d);
+		osp_spin_unlock(&(d->mutex));
+		wake_lock_waiters(d);
+		return r;
+	}
+
+	grant_lock(d, filp, writer);
+	incrementTicket(d, curTicket);
+	osp_spin_unlock(&(d->mutex));
+
+	/* Wake up all processes in the wait queue that were put to sleep by
+	 * wait_event_interruptible. */
+	wake_lock_waiters(d);
+	return 0;
+}
+
+/* Acquire a read or write lock on d, blocking until it is granted or
+ * 'timeout' jiffies pass.  Returns 0, -EDEADLK, -ERESTARTSYS if awoken by a
+ * signal, or -ETIMEDOUT. */
+static int acquire_lock(osprd_info_t *d, struct file *filp, int writer,
+			int cls, long timeout)
+{
+	/* DEADLOCK: Requesting same lock that the process already has OR
+	 * holding a lock in another device. */
+	if (holds_any_lock())
+		return -EDEADLK;
+
+	osp_spin_lock(&(d->mutex));
+	return queue_for_lock(d, filp, writer, cls, timeout);
+}
+
+/* Acquire a read or write lock on d only if acquire_lock would neither
+ * block nor deadlock.  Returns 0 or -EBUSY. */
+static int try_acquire_lock(osprd_info_t *d, struct file *filp, int writer)
+{
+	int ok;
+
+	if (holds_any_lock())
+		return -EBUSY;
+
+	osp_spin_lock(&(d->mutex));
+
+	if (writer)
+		ok = d->ticket_head == d->ticket_tail &&
+			writer_may_enter(d, d->ticket_tail);
+	else if (d->lock_policy == OSPRD_POLICY_PHASEFAIR)
+		ok = d->writeProcs == NULL && d->writersWaiting == 0;
+	else
+		ok = d->ticket_head == d->ticket_tail &&
+			reader_may_enter(d, d->ticket_tail);
+
+	if (!ok || !fast_lock_take(d, writer, 0)) {
+		// Instead of blocking, mark as busy.
+		osp_spin_unlock(&(d->mutex));
+		return -EBUSY;
+	}
+
+	grant_lock(d, filp, writer);
+	if (writer || d->lock_policy == OSPRD_POLICY_FIFO) {
+		/* Take and immediately serve a ticket. */
+		incrementTicket(d, takeTicket(d, task_lock_class(current)));
+	}
+	osp_spin_unlock(&(d->mutex));
+	wake_lock_waiters(d);
+	return 0;
+}
+
+/* Upgrade the current process's read lock on d to a write lock.  The
+ * upgrader counts as a waiting writer ahead of every queued request and
+ * gets the lock as soon as the other readers leave; it never gives up its
+ * read lock in between.  Returns 0, -EINVAL if no read lock is held,
+ * -EDEADLK if another reader is already upgrading (each would wait for the
+ * other to leave), or -ERESTARTSYS if awoken by a signal. */
+static int upgrade_lock(osprd_info_t *d, struct file *filp)
+{
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	int r;
+
+	osp_spin_lock(&(d->mutex));
+	if (!isInPidList(d->readProcs, current->pid)) {
+		osp_spin_unlock(&(d->mutex));
+		return -EINVAL;
+	}
+	if (d->upgrader != 0) {
+		osp_spin_unlock(&(d->mutex));
+		return -EDEADLK;
+	}
+	d->upgrader = current->pid;
+	d->writersWaiting = d->writersWaiting + 1;
+	atomic_inc((atomic_t *) &(d->fastlock->waiters));
+	osp_spin_unlock(&(d->mutex));
+
+	/* Our read lock must be the only one left, including user-space
+	 * readers counted in the shared lock word. */
+	for (;;) {
+		r = wait_for_lock(d, d->readProcs->size == 1 &&
+			d->admittedReaders == 0 && d->fastlock->state == 1,
+			timeout);
+		osp_spin_lock(&(d->mutex));
+		if (r != 0 || cmpxchg(&(d->fastlock->state), 1,
+				      OSPRD_FAST_WRITER) == 1)
+			break;
+		osp_spin_unlock(&(d->mutex));
+	}
+
+	atomic_dec((atomic_t *) &(d->fastlock->waiters));
+	d->upgrader = 0;
+	d->writersWaiting = d->writersWaiting - 1;
+	if (r != 0) {
+		/* Keep the read lock, but let in readers that were held back
+		 * by the upgrade. */
+		if (d->lock_policy == OSPRD_POLICY_PHASEFAIR &&
+			d->writersWaiting == 0 && d->writeProcs == NULL)
+			end_write_phase(d);
+		osp_spin_unlock(&(d->mutex));
+		wake_lock_waiters(d);
+		return r;
+	}
+	removeFromPidList(&(d->readProcs), current->pid);
+	grant_lock(d, filp, 1);
+	osp_spin_unlock(&(d->mutex));
+	return 0;
+}
+
+/* Downgrade the current process's write lock on d to a read lock, letting
+ * queued readers in with it.  Returns 0, or -EINVAL if no write lock is
+ * held. */
+static int downgrade_lock(osprd_info_t *d, struct file *filp)
+{
+	osp_spin_lock(&(d->mutex));
+	if (!isInPidList(d->writeProcs, current->pid)) {
+		osp_spin_unlock(&(d->mutex));
+		return -EINVAL;
+	}
+	removeFromPidList(&(d->writeProcs), current->pid);
+	grant_lock(d, filp, 0);
+	smp_mb();
+	d->fastlock->state = 1;
+	if (d->lock_policy == OSPRD_POLICY_PHASEFAIR)
+		end_write_phase(d);
+	osp_spin_unlock(&(d->mutex));
+	wake_lock_waiters(d);
+	return 0;
+}
+
+/* Release any lock the current process holds on d and cancel its pending
+ * notifications, then wake up blocked processes. */
+static void release_lock(osprd_info_t *d, struct file *filp)
+{
+	int wasWriter;
+
+	osp_spin_lock(&(d->mutex));
+
+	wasWriter = isInPidList(d->writeProcs, current->pid) != NULL;
+	if (wasWriter) {
+		removeFromPidList(&(d->writeProcs), current->pid);
+		fast_lock_put(d, 1);
+	}
+	if (isInPidList(d->readProcs, current->pid)) {
+		removeFromPidList(&(d->readProcs), current->pid);
+		fast_lock_put(d, 0);
+	}
+	if (isInPidList(d->notifProcs, current->pid))
+		removeFromPidList(&(d->notifProcs), current->pid);
+	if (isInPidList(d->writeNlkProcs, current->pid))
+		removeFromPidList(&(d->writeNlkProcs), current->pid);
+
+	if (wasWriter && d->lock_policy == OSPRD_POLICY_PHASEFAIR)
+		end_write_phase(d);
+
+	if (filp != NULL && d->readProcs == NULL && d->writeProcs == NULL)
+		filp->f_flags &= ~F_OSPRD_LOCKED; // Clear the lock
+
+	osp_spin_unlock(&(d->mutex));
+	wake_lock_waiters(d);
+}
 
-	if (!blk_fs_request(req)) {
-		end_request(req, 0);
-		return;
-	}
+/* Acquire every lock described by m, or none of them.  Devices are locked
+ * in index order, so multi-device requests can't deadlock each other.
+ * Returns 0, -EINVAL, -EBADF if the process has no file open on one of the
+ * devices, -EDEADLK if it already holds a lock, or -ERESTARTSYS if awoken
+ * by a signal. */
+static int acquire_multi_lock(struct osprd_multilock *m)
+{
+	struct file *files[NOSPRD];
+	int i, r = 0;
 
-	// EXERCISE: Perform the read or write request by copying data between
-	// our data array and the request's buffer.
-	// Hint: The 'struct request' argument tells you what kind of request
-	// this is, and which sectors are being read or written.
-	// Read about 'struct request' in <linux/blkdev.h>.
-	// Consider the 'req->sector', 'req->current_nr_sectors', and
-	// 'req->buffer' members, and the rq_data_dir() function.
+	if (m->devices == 0 || (m->devices >> NOSPRD) != 0)
+		return -EINVAL;
 
-	// Your code here.
-	
-	/* Get pointer to data on disk requested by the user.
-	 * req->sector: sector specified by the user to read/write to.
-	 * (req->sector * SECTOR_SIZE): offset */
-	dPtr = d->data + ((req->sector) * SECTOR_SIZE);
-        /* Determine whether the request is a read or a write.
-         * READ: 0, WRITE: 1 (defined in <linux/fs.h>) */
-	reqType = rq_data_dir(req);
-	/* req->current_nr_sectors: number of sectors to read/write to. */
-	if (reqType == READ) {
-		/* Copy contents of data buffer into request's buffer. */
-		memcpy((void*) req->buffer, (void*) dPtr, 
-			req->current_nr_sectors * SECTOR_SIZE);
-	}
-	else { // reqType == WRITE
-		/* Copy contents of request's buffer into data buffer. */
-		memcpy((void*) dPtr, (void*) req->buffer,
-			req->current_nr_sectors * SECTOR_SIZE);
-		/* Notify processes that requested change notifications. */
-		if (d->notifProcs != NULL) {
-			osp_spin_lock(&(d->mutex));
-			cur = d->notifProcs->head;
-			p = isInPidList(d->writeProcs, current->pid);
-			if (p == NULL)
-				p = isInPidList(d->writeNlkProcs, current->pid);
-			while (cur != NULL) {
-				cur->proc->reqNotif = 0;
-				/* Set the sector of the disk that was 
-				 * changed. */
-				cur->proc->sectors[p->sect] = 1;
-				cur = cur->next;
-			}
-			osp_spin_unlock(&(d->mutex));
-//			wake_up_all(&(d->blockq));
-		}
+	if (holds_any_lock())
+		return -EDEADLK;
+
+	/* Each lock is taken through a file the process has open on its
+	 * device, so that closing the file, or exiting, releases it. */
+	memset(files, 0, sizeof(files));
+	for (i = 0; i < NOSPRD; i++)
+		if ((m->devices & (1U << i))
+		    && !(files[i] = get_open_file(&osprds[i])))
+			r = -EBADF;
+
+	for (i = 0; i < NOSPRD && r == 0; i++) {
+		if (!(m->devices & (1U << i)))
+			continue;
+		osp_spin_lock(&(osprds[i].mutex));
+		r = queue_for_lock(&osprds[i], files[i], (m->writers >> i) & 1,
+				   task_lock_class(current),
+				   MAX_SCHEDULE_TIMEOUT);
+		/* Roll back the locks taken before the failure. */
+		if (r != 0)
+			while (--i >= 0)
+				if (m->devices & (1U << i))
+					release_lock(&osprds[i], files[i]);
 	}
 
-	end_request(req, 1);
+	for (i = 0; i < NOSPRD; i++)
+		if (files[i])
+			fput(files[i]);
+	return r;
 }
 
 
-// This function is called when a /dev/osprdX file is opened.
-// You aren't likely to need to change this.
-static int osprd_open(struct inode *inode, struct file *filp)
+/* Drop the locks still held in user space through filp, which is being
+ * closed for the last time, and free its slot.  A reader killed between
+ * taking the lock word and counting itself in its slot can still be
+ * missed, as can one killed between the two steps of its release. */
+static void drop_fast_slot(osprd_info_t *d, struct file *filp)
 {
-	// Always set the O_SYNC flag. That way, we will get writes immediately
-	// instead of waiting for them to get through write-back caches.
-	filp->f_flags |= O_SYNC;
-	return 0;
+	int slot, n;
+
+	osp_spin_lock(&(d->mutex));
+	slot = fast_slot(d, filp);
+	if (slot == 0) {
+		osp_spin_unlock(&(d->mutex));
+		return;
+	}
+	d->fastSlots[slot] = NULL;
+	cmpxchg(&(d->fastlock->state), OSPRD_FAST_OWNER(slot), 0);
+	n = xchg(&(d->fastlock->holds[slot]), 0);
+	if (n > 0)
+		atomic_sub(n, (atomic_t *) &(d->fastlock->state));
+	osp_spin_unlock(&(d->mutex));
+	wake_lock_waiters(d);
 }
 
 
@@ -425,32 +3482,20 @@ static int osprd_close_last(struct inode *inode, struct file *filp)
 
 		if (d == NULL)
 			return 1;
-		osp_spin_lock(&(d->mutex));
-
-		if (isInPidList(d->writeProcs, current->pid))
-			removeFromPidList(&(d->writeProcs), current->pid);
-		if (isInPidList(d->readProcs, current->pid))
-			removeFromPidList(&(d->readProcs), current->pid);
-		if (isInPidList(d->notifProcs, current->pid))
-			removeFromPidList(&(d->notifProcs), current->pid);
-		if (isInPidList(d->writeNlkProcs, current->pid))
-			removeFromPidList(&(d->writeNlkProcs), current->pid);
-
-		if (d->readProcs == NULL && d->writeProcs == NULL)
-			filp->f_flags &= !F_OSPRD_LOCKED; // Clear lock
-
-		osp_spin_unlock(&(d->mutex));
-		wake_up_all(&(d->blockq));
+		if (trace)
+			trace_event(d, OSPRD_TRACE_CLOSE, filp_writable != 0,
+				    0, 0, 0);
+		cancel_async_request(d, filp);
+		remove_change_ring(d, filp);
+		drop_snapshot(d, filp);
+		drop_fast_slot(d, filp);
+		release_lock(d, filp);
 	}
 
 	return 0;
 }
 
 
-/*
- * osprd_lock
- */
-
 /*
  * osprd_ioctl(inode, filp, cmd, arg)
  *   Called to perform an ioctl on the named file.
@@ -463,7 +3508,6 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 	// is file open for writing?
 	int filp_writable = (filp->f_mode & FMODE_WRITE) != 0;
-	unsigned curTicket;
 	struct process* newProc;
 	struct process* tmp;
 	unsigned long sector = 0; // User did not specify sector (for 
@@ -474,6 +3518,9 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 	// Set 'r' to the ioctl's return value: 0 on success, negative on error
 
+	if (trace)
+		trace_event(d, OSPRD_TRACE_IOCTL, filp_writable, cmd, 0, arg);
+
 	if (cmd == OSPRDIOCSECTOR) {
 		
 		if (d->notifProcs != NULL) {
@@ -561,149 +3608,9 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 		// be protected by a spinlock; which ones?)
 
 		// Your code here (instead of the next two lines).
-		if (filp_writable) { // Requested a write lock
-
-			osp_spin_lock(&(d->mutex));
-			/* Current process gets a ticket from ticket_head. */
-			curTicket = d->ticket_head;
-			d->ticket_head = d->ticket_head + 1;
-
-			/* DEADLOCK: Requesting same lock that the process 
-			 * already has OR there is a process that is reading.
-			 */
-			if (isInPidList(d->writeProcs, current->pid) || 
-				isInPidList(d->readProcs, current->pid)) {
-				wake_up_all(&(d->blockq));
-				d->isHoldingOtherLocks = 0;
-				incrementTicket(d);	
-				osp_spin_unlock(&(d->mutex));
-				return -EDEADLK;
-			}
-
-			/* DEADLOCK: Holding a lock in another device. */
-			for_each_open_file(current, checkForOtherLocks, d);
-			if (d->isHoldingOtherLocks) {
-
-				wake_up_all(&(d->blockq));
-                                d->isHoldingOtherLocks = 0;
-                                incrementTicket(d);
-                                osp_spin_unlock(&(d->mutex));
-                                return -EDEADLK;
-			}
+		r = acquire_lock(d, filp, filp_writable,
+				 task_lock_class(current), MAX_SCHEDULE_TIMEOUT);
 
-			osp_spin_unlock(&(d->mutex));
-			
-			/* In order to get the write lock, it must be the 
-			 * process's turn (so its ticket must match 
-			 * ticket_tail) and no other process can be reading or
-			 * writing. */
-			if (wait_event_interruptible(d->blockq, 
-				curTicket == d->ticket_tail &&
-				d->readProcs == NULL && 
-				d->writeProcs == NULL)) {
-				/* Conditions were not met so add to 
-				 * wait_queue_head_t with state marked as 
-				 * TASK_INTERRUPTIBLE. */
-			
-				if (d->ticket_tail == curTicket)
-					incrementTicket(d);
-				else
-					addToTicketList(&(d->exitedTickets),
-						curTicket);
-	
-				return -ERESTARTSYS;
-			}
-			
-			/* wait_event_interruptible returned 0 so the 
-			 * conditions were met! This means the process has the 
-			 * ticket to continue and no other process has a read 
-			 * or write lock.*/
-			osp_spin_lock(&(d->mutex));
-			filp->f_flags |= F_OSPRD_LOCKED; // Claim the lock
-
-			newProc = kzalloc(sizeof(struct process), GFP_ATOMIC);
-			newProc->info = current;
-			newProc->reqNotif = 0;
-			addToPidList(&(d->writeProcs), newProc);
-			incrementTicket(d);
-
-			osp_spin_unlock(&(d->mutex));
-			/* Wake up all processes in the wait queue that were
-			 * put to sleep by wait_event_interruptible. */
-			wake_up_all(&(d->blockq));
-			return 0;
-		}
-		else { // Requested a read lock
-
-			osp_spin_lock(&(d->mutex));
-			/* Current process gets a ticket from ticket_head. */
-			curTicket = d->ticket_head;
-			d->ticket_head = d->ticket_head + 1;
-
-			/* DEADLOCK: Requesting same lock that the process 
-                         * already has OR there is a process that is writing.
-                         */
-                        if (isInPidList(d->readProcs, current->pid) ||
-                                isInPidList(d->writeProcs, current->pid)) {
-
-                                wake_up_all(&(d->blockq));
-                                d->isHoldingOtherLocks = 0;
-                                incrementTicket(d);
-                                osp_spin_unlock(&(d->mutex));
-                                return -EDEADLK;
-                        }
-
-                        /* DEADLOCK: Holding a lock in another device. */
-                        for_each_open_file(current, checkForOtherLocks, d);
-                        if (d->isHoldingOtherLocks) {
-
-                                wake_up_all(&(d->blockq));
-                                d->isHoldingOtherLocks = 0;
-                                incrementTicket(d);
-                                osp_spin_unlock(&(d->mutex));
-                                return -EDEADLK;
-                        }
-
-			osp_spin_unlock(&(d->mutex));
-
-			/* In order to get the read lock, it must be the 
-                         * process's turn (so its ticket must match 
-                         * ticket_tail) and no other process can be writing. */
-			if (wait_event_interruptible(d->blockq, 
-				curTicket == d->ticket_tail &&
-				d->writeProcs == NULL)) {
-				/* Conditions were not met so add to 
-                                 * wait_queue_head_t with state marked as 
-                                 * TASK_INTERRUPTIBLE. */
-				if (curTicket == d->ticket_tail)
-					incrementTicket(d);
-				else
-					addToTicketList(&(d->exitedTickets),
-						curTicket);
-
-				return -ERESTARTSYS;
-			}
-
-			/* wait_event_interruptible returned 0 so the 
-                         * conditions were met! This means the process has the 
-                         * ticket to continue and no other process has a write 
-                         * lock.*/
-			osp_spin_lock(&(d->mutex));
-			filp->f_flags |= F_OSPRD_LOCKED; // Claim the lock
-
-			newProc = kzalloc(sizeof(struct process), GFP_ATOMIC);
-			newProc->info = current;
-			newProc->reqNotif = 0;
-			addToPidList(&(d->readProcs), newProc);
-			incrementTicket(d);
-
-			osp_spin_unlock(&(d->mutex));
-			/* Wake up all processes in the wait queue that were
-                         * put to sleep by wait_event_interruptible. */
-			wake_up_all(&(d->blockq));
-			r = 0;
-		}
-		
 	} else if (cmd == OSPRDIOCTRYACQUIRE) {
 
 		// EXERCISE: ATTEMPT to lock the ramdisk.
@@ -714,48 +3621,69 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 		// Otherwise, if we can grant the lock request, return 0.
 
 		// Your code here (instead of the next two lines).
-		
-		/* Acquire the lock only if it's possible. */
-		for_each_open_file(current, checkForOtherLocks, d);
+		r = try_acquire_lock(d, filp, filp_writable);
+
+	} else if (cmd == OSPRDIOCTIMEDACQUIRE) {
+
+		/* Like OSPRDIOCACQUIRE, but wait at most 'arg' milliseconds
+		 * and return -ETIMEDOUT if the lock wasn't granted by then.
+		 * Wait at least one tick so that a free lock is still
+		 * granted when 'arg' is 0. */
+		long timeout = msecs_to_jiffies(arg);
+		if (timeout <= 0)
+			timeout = 1;
+		r = acquire_lock(d, filp, filp_writable,
+				 task_lock_class(current), timeout);
+
+	} else if (cmd == OSPRDIOCCLASSACQUIRE) {
+
+		/* Like OSPRDIOCACQUIRE, with the class given by 'arg' rather
+		 * than by the process's nice value. */
+		if (arg >= OSPRD_NCLASSES)
+			return -EINVAL;
+		r = acquire_lock(d, filp, filp_writable, (int) arg,
+				 MAX_SCHEDULE_TIMEOUT);
+
+	} else if (cmd == OSPRDIOCSYNC) {
+
+		/* Only this file changes; write-back pages it already left
+		 * in the page cache are flushed by fsync() as usual. */
+		if (arg)
+			filp->f_flags |= O_SYNC;
+		else
+			filp->f_flags &= ~O_SYNC;
 
-		if (d->writeProcs == NULL && !d->isHoldingOtherLocks &&
-			(!filp_writable | (d->readProcs == NULL))) {
-			/* Acquired the lock successfully! */
+	} else if (cmd == OSPRDIOCTHROTTLE) {
 
-			osp_spin_lock(&(d->mutex));
-			/* Current process gets a ticket from ticket_head. */
-			curTicket = d->ticket_head;
-			d->ticket_head = d->ticket_head + 1;
+		struct osprd_throttle t;
+		if (!filp_writable)
+			return -EBADF;
+		if (copy_from_user(&t, (void __user *) arg, sizeof(t)))
+			return -EFAULT;
+		r = set_throttle(d, &t);
 
-			if (filp_writable) { // Requested a write lock
-				
-				filp->f_flags |= F_OSPRD_LOCKED;
+	} else if (cmd == OSPRDIOCTHROTTLESTAT) {
 
-				newProc = kzalloc(sizeof(struct process),
-					GFP_ATOMIC);
-				newProc->info = current;
-				newProc->reqNotif = 0;
-				addToPidList(&(d->writeProcs), newProc);
-				incrementTicket(d);
-			}
-			else { // Requested a read lock
+		struct osprd_throttle t;
+		if (copy_from_user(&t, (void __user *) arg, sizeof(t)))
+			return -EFAULT;
+		get_throttle(d, &t);
+		if (copy_to_user((void __user *) arg, &t, sizeof(t)))
+			r = -EFAULT;
 
-				filp->f_flags |= F_OSPRD_LOCKED;
+	} else if (cmd == OSPRDIOCSCRUB) {
 
-				newProc = kzalloc(sizeof(struct process),
-					GFP_ATOMIC);
-				newProc->info = current;
-				newProc->reqNotif = 0;
-				addToPidList(&(d->readProcs), newProc);
-				incrementTicket(d);
-			}
+		/* The scrub sleeps; it takes no lock, so writers go on. */
+		struct osprd_scrub s;
+		r = scrub_device(d, &s);
+		if (r == 0 && copy_to_user((void __user *) arg, &s, sizeof(s)))
+			r = -EFAULT;
 
-			wake_up_all(&(d->blockq));
-			r = 0;
-			osp_spin_unlock(&(d->mutex));
-		}
-		else // Instead of blocking, mark as busy. 
-			r = -EBUSY;
+	} else if (cmd == OSPRDIOCSNAPSHOT) {
+
+		/* A snapshot takes no lock, so it neither waits for writers
+		 * nor holds them up. */
+		r = take_snapshot(d, filp);
 
 	} else if (cmd == OSPRDIOCRELEASE) {
 
@@ -767,22 +3695,137 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 		// you need, and return 0.
 
 		// Your code here (instead of the next line).
-		osp_spin_lock(&(d->mutex));
-		
-		if (isInPidList(d->writeProcs, current->pid))
-			removeFromPidList(&(d->writeProcs), current->pid);
-		if (isInPidList(d->readProcs, current->pid))
-			removeFromPidList(&(d->readProcs), current->pid);
-		if (isInPidList(d->notifProcs, current->pid))
-                        removeFromPidList(&(d->notifProcs), current->pid);
-		if (isInPidList(d->writeNlkProcs, current->pid))
-			removeFromPidList(&(d->writeNlkProcs), current->pid);
-
-		if (d->readProcs == NULL && d->writeProcs == NULL)
-			filp->f_flags &= !F_OSPRD_LOCKED; // Clear the lock
-
-		wake_up_all(&(d->blockq));
+		release_lock(d, filp);
+		drop_snapshot(d, filp);
 		r = 0;
+
+	} else if (cmd == OSPRDIOCUPGRADE) {
+
+		r = upgrade_lock(d, filp);
+
+	} else if (cmd == OSPRDIOCDOWNGRADE) {
+
+		r = downgrade_lock(d, filp);
+
+	} else if (cmd == OSPRDIOCMULTIACQUIRE ||
+		   cmd == OSPRDIOCMULTIRELEASE) {
+
+		struct osprd_multilock m;
+		int i;
+		if (copy_from_user(&m, (void __user *) arg, sizeof(m)))
+			return -EFAULT;
+		if (cmd == OSPRDIOCMULTIACQUIRE)
+			r = acquire_multi_lock(&m);
+		else if (m.devices == 0 || (m.devices >> NOSPRD) != 0)
+			r = -EINVAL;
+		else
+			for (i = 0; i < NOSPRD; i++) {
+				struct file *f;
+				if (!(m.devices & (1U << i)))
+					continue;
+				f = get_open_file(&osprds[i]);
+				release_lock(&osprds[i], f);
+				if (f)
+					fput(f);
+			}
+
+	} else if (cmd == OSPRDIOCENQUEUE) {
+
+		r = enqueue_lock(d, filp, filp_writable);
+
+	} else if (cmd == OSPRDIOCCANCEL) {
+
+		r = cancel_async_request(d, filp);
+
+	} else if (cmd == OSPRDIOCRING) {
+
+		r = setup_change_ring(d, filp, (unsigned) arg);
+
+	} else if (cmd == OSPRDIOCCHANGED) {
+
+		struct osprd_changes c;
+		if (copy_from_user(&c, (void __user *) arg, sizeof(c)))
+			return -EFAULT;
+		r = get_changed_sectors(d, &c);
+		if ((r == 0 || r == -ENOSPC) &&
+		    copy_to_user((void __user *) arg, &c, sizeof(c)))
+			r = -EFAULT;
+
+	} else if (cmd == OSPRDIOCMIRROR) {
+
+		/* The mirror's contents are overwritten, so only writers may
+		 * set one up. */
+		if (!filp_writable)
+			return -EBADF;
+		r = set_mirror(d, (int) arg);
+
+	} else if (cmd == OSPRDIOCLOCKSTAT) {
+
+		struct osprd_lock_stat st;
+		int c;
+		osp_spin_lock(&(d->mutex));
+		st.spin_acquires = d->spinAcquires;
+		st.sleep_acquires = d->sleepAcquires;
+		for (c = 0; c < OSPRD_NCLASSES; c++) {
+			st.classes[c].acquires = d->classAcquires[c];
+			st.classes[c].wait_usecs = d->classWait[c];
+			st.classes[c].max_wait_usecs = d->classMaxWait[c];
+		}
+		osp_spin_unlock(&(d->mutex));
+		if (copy_to_user((void __user *) arg, &st, sizeof(st)))
+			r = -EFAULT;
+
+	} else if (cmd == OSPRDIOCMIRRORSTAT) {
+
+		struct osprd_mirror_stat st;
+		spin_lock_irq(&d->qlock);
+		st.mirror = d->mirror ? d->mirror - osprds : OSPRD_MIRROR_NONE;
+		st.lag = d->mirrorLag;
+		st.copied = d->mirrorCopied;
+		spin_unlock_irq(&d->qlock);
+		if (copy_to_user((void __user *) arg, &st, sizeof(st)))
+			r = -EFAULT;
+
+	} else if (cmd == OSPRDIOCFASTWAIT) {
+		int slot;
+
+		/* Slow path of osprd_fast_lock(): the lock word was
+		 * contended, so sleep until it can be taken.  Fast-path locks
+		 * skip the ticket queue, like a futex, and are recorded in
+		 * the file's slot. */
+		osp_spin_lock(&(d->mutex));
+		slot = fast_slot(d, filp);
+		osp_spin_unlock(&(d->mutex));
+		atomic_inc((atomic_t *) &(d->fastlock->waiters));
+		r = wait_event_interruptible(d->blockq,
+			fast_lock_take(d, arg != 0, slot));
+		atomic_dec((atomic_t *) &(d->fastlock->waiters));
+
+	} else if (cmd == OSPRDIOCFASTSLOT) {
+
+		r = give_fast_slot(d, filp);
+
+	} else if (cmd == OSPRDIOCFASTWAKE) {
+
+		/* Slow path of osprd_fast_unlock(): somebody is sleeping on
+		 * the lock word. */
+		wake_lock_waiters(d);
+
+	} else if (cmd == OSPRDIOCSETPOLICY) {
+
+		/* The policy can only change while nobody holds or waits for
+		 * the lock, since the two policies count waiters
+		 * differently. */
+		if (arg != OSPRD_POLICY_FIFO && arg != OSPRD_POLICY_PHASEFAIR)
+			return -EINVAL;
+		osp_spin_lock(&(d->mutex));
+		if (d->readProcs != NULL || d->writeProcs != NULL ||
+			d->ticket_head != d->ticket_tail ||
+			d->blockedReaders != 0 || d->admittedReaders != 0 ||
+			d->asyncReqs != NULL)
+			r = -EBUSY;
+		else
+			d->lock_policy = (int) arg;
 		osp_spin_unlock(&(d->mutex));
 
 	} else
@@ -801,8 +3844,22 @@ static void osprd_setup(osprd_info_t *d)
 	d->ticket_head = d->ticket_tail = 0;
 	/* Add code here if you add fields to osprd_info_t. */
 	d->readProcs = d->writeProcs = d->notifProcs = d->writeNlkProcs = NULL;
-	d->exitedTickets = NULL;
-	d->isHoldingOtherLocks = 0;
+	memset(d->waitingTickets, 0, sizeof(d->waitingTickets));
+	if (lock_policy == OSPRD_POLICY_PHASEFAIR)
+		d->lock_policy = OSPRD_POLICY_PHASEFAIR;
+	else
+		d->lock_policy = OSPRD_POLICY_FIFO;
+	d->write_phase = d->writersWaiting = 0;
+	d->blockedReaders = d->admittedReaders = 0;
+	d->upgrader = 0;
+	d->asyncReqs = NULL;
+	d->mirror = NULL;
+	d->mirrorLag = d->mirrorBusy = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+	INIT_WORK(&d->mirrorWork, mirror_work, d);
+#else
+	INIT_WORK(&d->mirrorWork, mirror_work);
+#endif
 }
 
 
@@ -819,8 +3876,20 @@ static void osprd_process_request_queue(request_queue_t *q)
 	osprd_info_t *d = (osprd_info_t *) q->queuedata;
 	struct request *req;
 
-	while ((req = elv_next_request(q)) != NULL)
-		osprd_process_request(d, req);
+	while ((req = elv_next_request(q)) != NULL) {
+		if (d->backing && blk_fs_request(req)) {
+			// Cache mode: the cache thread serves the request,
+			// all of it at once.
+			if (trace)
+				trace_event(d, OSPRD_TRACE_REQUEST,
+					    rq_data_dir(req) == WRITE, 0,
+					    req->sector, req->nr_sectors);
+			blkdev_dequeue_request(req);
+			list_add_tail(&req->queuelist, &d->cacheReqs);
+			wake_up(&d->cacheq);
+		} else
+			osprd_process_request(d, req);
+	}
 }
 
 
@@ -830,6 +3899,11 @@ static void osprd_process_request_queue(request_queue_t *q)
 
 static struct file_operations osprd_blk_fops;
 static int (*blkdev_release)(struct inode *, struct file *);
+static int (*blkdev_mmap)(struct file *, struct vm_area_struct *);
+static unsigned int (*blkdev_poll)(struct file *, struct poll_table_struct *);
+static ssize_t (*blkdev_read)(struct file *, char __user *, size_t, loff_t *);
+static ssize_t (*blkdev_write)(struct file *, const char __user *, size_t,
+			       loff_t *);
 
 static int _osprd_release(struct inode *inode, struct file *filp)
 {
@@ -838,12 +3912,98 @@ static int _osprd_release(struct inode *inode, struct file *filp)
 	return (*blkdev_release)(inode, filp);
 }
 
+// mmap()ing a ramdisk file at OSPRD_MMAP_FASTLOCK maps the device's shared
+// lock page, and at OSPRD_MMAP_RING maps the file's change ring; other
+// offsets map the disk contents as usual.
+
+static int _osprd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	osprd_info_t *d = file2osprd(filp);
+	struct ringSub *sub;
+	if (d && vma->vm_pgoff == (OSPRD_MMAP_FASTLOCK >> PAGE_SHIFT)) {
+		if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+			return -EINVAL;
+		return remap_pfn_range(vma, vma->vm_start,
+				       virt_to_phys(d->fastlock) >> PAGE_SHIFT,
+				       PAGE_SIZE, vma->vm_page_prot);
+	}
+	if (d && vma->vm_pgoff == (OSPRD_MMAP_RING >> PAGE_SHIFT)) {
+		// The ring lives until filp is closed, and the mapping keeps
+		// filp open.
+		spin_lock_irq(&d->qlock);
+		sub = find_change_ring(d, filp);
+		spin_unlock_irq(&d->qlock);
+		if (!sub)
+			return -EINVAL;
+		return remap_vmalloc_range(vma, sub->ring, 0);
+	}
+	return blkdev_mmap ? (*blkdev_mmap)(filp, vma) : -ENODEV;
+}
+
+// poll() on a ramdisk file reports it readable unless a lock request queued
+// with OSPRDIOCENQUEUE on it is still waiting to be granted.
+
+static unsigned int _osprd_poll(struct file *filp, poll_table *wait)
+{
+	osprd_info_t *d = file2osprd(filp);
+	unsigned int mask = POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+	if (d) {
+		poll_wait(filp, &d->blockq, wait);
+		osp_spin_lock(&d->mutex);
+		if (find_async_request(d, filp) != NULL)
+			mask = 0;
+		osp_spin_unlock(&d->mutex);
+		return mask;
+	}
+	return blkdev_poll ? (*blkdev_poll)(filp, wait) : mask;
+}
+
+// read() and write() on a ramdisk file first wait out the process's
+// throttling limits.  read() on a file that took a snapshot with
+// OSPRDIOCSNAPSHOT reads the snapshot, bypassing the page cache; otherwise
+// it reads as usual.
+
+static ssize_t _osprd_read(struct file *filp, char __user *buf, size_t count,
+			   loff_t *ppos)
+{
+	osprd_info_t *d = file2osprd(filp);
+	struct snapshot *s;
+	ssize_t r = d ? throttle_io(d, count) : 0;
+	if (r)
+		return r;
+	s = d ? get_file_snapshot(d, filp) : NULL;
+	if (s) {
+		r = read_snapshot(d, s, buf, count, ppos);
+		put_snapshot(d, s);
+		return r;
+	}
+	return blkdev_read ? (*blkdev_read)(filp, buf, count, ppos) : -EINVAL;
+}
+
+static ssize_t _osprd_write(struct file *filp, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	osprd_info_t *d = file2osprd(filp);
+	ssize_t r = d ? throttle_io(d, count) : 0;
+	if (r)
+		return r;
+	return blkdev_write ? (*blkdev_write)(filp, buf, count, ppos) : -EINVAL;
+}
+
 static int _osprd_open(struct inode *inode, struct file *filp)
 {
 	if (!osprd_blk_fops.open) {
 		memcpy(&osprd_blk_fops, filp->f_op, sizeof(osprd_blk_fops));
 		blkdev_release = osprd_blk_fops.release;
 		osprd_blk_fops.release = _osprd_release;
+		blkdev_mmap = osprd_blk_fops.mmap;
+		osprd_blk_fops.mmap = _osprd_mmap;
+		blkdev_poll = osprd_blk_fops.poll;
+		osprd_blk_fops.poll = _osprd_poll;
+		blkdev_read = osprd_blk_fops.read;
+		osprd_blk_fops.read = _osprd_read;
+		blkdev_write = osprd_blk_fops.write;
+		osprd_blk_fops.write = _osprd_write;
 	}
 	filp->f_op = &osprd_blk_fops;
 	return osprd_open(inode, filp);
@@ -878,6 +4038,31 @@ static osprd_info_t *file2osprd(struct file *filp)
 }
 
 
+// Call the function 'callback' with data 'user_data' for each of 'task's
+// open files.
+
+static struct file *get_open_file(osprd_info_t *d)
+{
+	struct file *found = NULL;
+	int fd;
+	spin_lock(&current->files->file_lock);
+	{
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 13)
+		struct files_struct *f = current->files;
+#else
+		struct fdtable *f = current->files->fdt;
+#endif
+		for (fd = 0; fd < f->max_fds && !found; fd++)
+			if (f->fd[fd] && file2osprd(f->fd[fd]) == d) {
+				found = f->fd[fd];
+				get_file(found);
+			}
+	}
+	spin_unlock(&current->files->file_lock);
+	return found;
+}
+
+
 // Call the function 'callback' with data 'user_data' for each of 'task's
 // open files.
 
@@ -903,6 +4088,52 @@ static void for_each_open_file(struct task_struct *task,
 }
 
 
+// Allocate d's data array, placed as d->node says.  Interleaved pages are
+// allocated one by one, round robin over the online nodes, and mapped
+// together with vmap().
+
+static uint8_t *alloc_data(osprd_info_t *d, unsigned long size)
+{
+	int node = first_online_node;
+	unsigned long i;
+
+	if (d->node == NUMA_ANY)
+		return vmalloc(size);
+	if (d->node >= 0)
+		return vmalloc_node(size, d->node);
+
+	d->npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	if (!(d->pages = vmalloc(d->npages * sizeof(struct page *))))
+		return NULL;
+	memset(d->pages, 0, d->npages * sizeof(struct page *));
+	for (i = 0; i < d->npages; i++) {
+		if (!(d->pages[i] = alloc_pages_node(node, GFP_KERNEL
+						      | __GFP_HIGHMEM, 0)))
+			return NULL;
+		node = next_online_node(node);
+		if (node == MAX_NUMNODES)
+			node = first_online_node;
+	}
+	return vmap(d->pages, d->npages, VM_MAP, PAGE_KERNEL);
+}
+
+static void free_data(osprd_info_t *d)
+{
+	unsigned long i;
+
+	if (!d->pages) {
+		if (d->data)
+			vfree(d->data);
+		return;
+	}
+	if (d->data)
+		vunmap(d->data);
+	for (i = 0; i < d->npages && d->pages[i]; i++)
+		__free_page(d->pages[i]);
+	vfree(d->pages);
+}
+
+
 // Destroy a osprd_info_t.
 
 static void cleanup_device(osprd_info_t *d)
@@ -912,10 +4143,32 @@ static void cleanup_device(osprd_info_t *d)
 		del_gendisk(d->gd);
 		put_disk(d->gd);
 	}
+	if (d->cacheThread)
+		kthread_stop(d->cacheThread);
 	if (d->queue)
 		blk_cleanup_queue(d->queue);
-	if (d->data)
-		vfree(d->data);
+	if (d->backing)
+		filp_close(d->backing, NULL);
+	if (d->cacheTag)
+		vfree(d->cacheTag);
+	if (d->cacheDirty)
+		vfree(d->cacheDirty);
+	free_data(d);
+	if (d->sectorGen)
+		vfree(d->sectorGen);
+	if (d->mirrorDirty)
+		vfree(d->mirrorDirty);
+	if (d->crcs)
+		vfree(d->crcs);
+	if (d->fastlock) {
+		ClearPageReserved(virt_to_page(d->fastlock));
+		free_page((unsigned long) d->fastlock);
+	}
+	while (d->buckets) {
+		struct throttleBucket *b = d->buckets;
+		d->buckets = b->next;
+		kfree(b);
+	}
 }
 
 
@@ -923,19 +4176,124 @@ static void cleanup_device(osprd_info_t *d)
 
 static int setup_device(osprd_info_t *d, int which)
 {
+	unsigned long i;
+
 	memset(d, 0, sizeof(osprd_info_t));
 
-	/* Get memory to store the actual block data. */
-	if (!(d->data = vmalloc(nsectors * SECTOR_SIZE)))
+	/* Check the logical block size. */
+	if ((block_size[which] != SECTOR_SIZE && block_size[which] != 4096)
+	    || nsectors % (block_size[which] / SECTOR_SIZE) != 0) {
+		printk(KERN_WARNING "osprd: bad block size %d for %d sectors\n",
+		       block_size[which], nsectors);
+		return -1;
+	}
+
+	/* Get memory to store the actual block data, on the requested NUMA
+	 * node(s). */
+	d->node = NUMA_ANY;
+	if (numa[which] && strcmp(numa[which], "interleave") == 0)
+		d->node = NUMA_INTERLEAVE;
+	else if (numa[which]) {
+		d->node = simple_strtol(numa[which], NULL, 10);
+		if (d->node < 0 || d->node >= MAX_NUMNODES
+		    || !node_online(d->node)) {
+			printk(KERN_WARNING "osprd: bad NUMA node %s\n",
+			       numa[which]);
+			return -1;
+		}
+	}
+	if (!(d->data = alloc_data(d, nsectors * SECTOR_SIZE)))
 		return -1;
 	memset(d->data, 0, nsectors * SECTOR_SIZE);
 
+	/* In cache mode, open the backing file, which sets the size of the
+	 * disk, and start with an empty cache. */
+	d->nsectors = nsectors;
+	if (backing[which]) {
+		if (nsectors % CACHE_LINE != 0) {
+			printk(KERN_WARNING "osprd: nsectors must be a multiple of %d in cache mode\n",
+			       CACHE_LINE);
+			return -1;
+		}
+		d->backing = filp_open(backing[which], O_RDWR | O_LARGEFILE, 0);
+		if (IS_ERR(d->backing)) {
+			printk(KERN_WARNING "osprd: can't open %s\n",
+			       backing[which]);
+			d->backing = NULL;
+			return -1;
+		}
+		d->nsectors = i_size_read(d->backing->f_mapping->host)
+			>> 9;
+		d->nsectors -= d->nsectors % CACHE_LINE;
+		if (!(d->cacheTag = vmalloc(nsectors / CACHE_LINE
+					    * sizeof(unsigned long))))
+			return -1;
+		memset(d->cacheTag, 0xFF,
+		       nsectors / CACHE_LINE * sizeof(unsigned long));
+		if (!(d->cacheDirty = vmalloc(BITS_TO_LONGS(nsectors
+			/ CACHE_LINE) * sizeof(unsigned long))))
+			return -1;
+		bitmap_zero(d->cacheDirty, nsectors / CACHE_LINE);
+	}
+	INIT_LIST_HEAD(&d->cacheReqs);
+	init_waitqueue_head(&d->cacheq);
+	INIT_LIST_HEAD(&d->bigWrites);
+	init_waitqueue_head(&d->bigWriteq);
+
+	/* Every sector starts out at generation 0. */
+	if (!(d->sectorGen = vmalloc(d->nsectors * sizeof(*d->sectorGen))))
+		return -1;
+	memset(d->sectorGen, 0, d->nsectors * sizeof(*d->sectorGen));
+
+	/* No sector needs mirroring until a mirror is set up. */
+	if (!(d->mirrorDirty = vmalloc(BITS_TO_LONGS(d->nsectors)
+				       * sizeof(unsigned long))))
+		return -1;
+	bitmap_zero(d->mirrorDirty, d->nsectors);
+
+	/* Every sector starts out as zeros, with the checksum of zeros. */
+	if (checksum[which] && d->backing)
+		printk(KERN_WARNING "osprd: no checksums in cache mode\n");
+	else if (checksum[which]) {
+		if (!(d->crcs = vmalloc(d->nsectors * sizeof(*d->crcs))))
+			return -1;
+		sector_crcs(d->data, 1, d->crcs);
+		for (i = 1; i < d->nsectors; i++)
+			d->crcs[i] = d->crcs[0];
+	}
+
+	/* Get a page for the lock state shared with user space. */
+	if (!(d->fastlock = (struct osprd_fastlock *)
+	      get_zeroed_page(GFP_KERNEL)))
+		return -1;
+	SetPageReserved(virt_to_page(d->fastlock));
+
 	/* Set up the I/O queue. */
 	spin_lock_init(&d->qlock);
-	if (!(d->queue = blk_init_queue(osprd_process_request_queue, &d->qlock)))
+	if (!(d->queue = blk_init_queue_node(osprd_process_request_queue,
+					     &d->qlock,
+					     d->node >= 0 ? d->node : -1)))
 		return -1;
-	blk_queue_hardsect_size(d->queue, SECTOR_SIZE);
+	blk_queue_hardsect_size(d->queue, block_size[which]);
+	blk_queue_max_sectors(d->queue, OSPRD_MAX_SECTORS);
+	blk_queue_max_phys_segments(d->queue, OSPRD_MAX_SEGMENTS);
+	blk_queue_max_hw_segments(d->queue, OSPRD_MAX_SEGMENTS);
+	blk_queue_max_segment_size(d->queue, OSPRD_MAX_SECTORS * SECTOR_SIZE);
 	d->queue->queuedata = d;
+	/* Not blk_queue_make_request(), which would reset the limits. */
+	queue_make_request = d->queue->make_request_fn;
+	d->queue->make_request_fn = osprd_make_request;
+
+	/* The cache thread must be running before add_disk() reads the
+	 * partition table. */
+	if (d->backing) {
+		d->cacheThread = kthread_run(cache_thread, d, "osprd%c",
+					     which + 'a');
+		if (IS_ERR(d->cacheThread)) {
+			d->cacheThread = NULL;
+			return -1;
+		}
+	}
 
 	/* The gendisk structure. */
 	if (!(d->gd = alloc_disk(1)))
@@ -946,7 +4304,7 @@ static int setup_device(osprd_info_t *d, int which)
 	d->gd->queue = d->queue;
 	d->gd->private_data = d;
 	snprintf(d->gd->disk_name, 32, "osprd%c", which + 'a');
-	set_capacity(d->gd, nsectors);
+	set_capacity(d->gd, d->nsectors);
 	add_disk(d->gd);
 
 	/* Call the setup function. */
@@ -955,6 +4313,81 @@ static int setup_device(osprd_info_t *d, int which)
 	return 0;
 }
 
+
+// The striped device's operations: it has no locks or ioctls.
+
+static struct block_device_operations stripe_ops = {
+	.owner = THIS_MODULE
+};
+
+
+// Destroy the striped device.
+
+static void cleanup_stripe(osprd_stripe_t *st)
+{
+	if (st->gd) {
+		del_gendisk(st->gd);
+		put_disk(st->gd);
+	}
+	if (st->queue)
+		blk_cleanup_queue(st->queue);
+}
+
+
+// Initialize the striped device, if stripe_members asks for one.
+
+static int setup_stripe(osprd_stripe_t *st)
+{
+	unsigned hardsect = SECTOR_SIZE;
+	int i;
+
+	memset(st, 0, sizeof(osprd_stripe_t));
+	if (stripe_members == 0)
+		return 0;
+
+	/* Every chunk must hold whole blocks of every member. */
+	for (i = 0; i < NOSPRD; i++)
+		if (stripe_members & (1 << i)) {
+			st->members[st->nmembers++] = &osprds[i];
+			hardsect = max_t(unsigned, hardsect, block_size[i]);
+		}
+	for (i = 0; i < st->nmembers; i++)
+		if (st->members[i]->backing != NULL) {
+			printk(KERN_WARNING "osprd: can't stripe over a device in cache mode\n");
+			return -1;
+		}
+	if ((stripe_members & ~((1 << NOSPRD) - 1)) || stripe_chunk <= 0
+	    || stripe_chunk > nsectors
+	    || stripe_chunk % (hardsect / SECTOR_SIZE) != 0) {
+		printk(KERN_WARNING "osprd: bad stripe_members or stripe_chunk\n");
+		return -1;
+	}
+	st->chunk = stripe_chunk;
+	st->nsectors = (unsigned long) (nsectors / st->chunk) * st->chunk
+		* st->nmembers;
+
+	/* A queue without a request function: bios go to
+	 * stripe_make_request. */
+	if (!(st->queue = blk_alloc_queue(GFP_KERNEL)))
+		return -1;
+	blk_queue_make_request(st->queue, stripe_make_request);
+	blk_queue_hardsect_size(st->queue, hardsect);
+	blk_queue_max_sectors(st->queue, OSPRD_MAX_SECTORS);
+	st->queue->queuedata = st;
+
+	if (!(st->gd = alloc_disk(1)))
+		return -1;
+	st->gd->major = OSPRD_MAJOR;
+	st->gd->first_minor = NOSPRD;
+	st->gd->fops = &stripe_ops;
+	st->gd->queue = st->queue;
+	st->gd->private_data = st;
+	snprintf(st->gd->disk_name, 32, "osprd%c", NOSPRD + 'a');
+	set_capacity(st->gd, st->nsectors);
+	add_disk(st->gd);
+	return 0;
+}
+
 static void osprd_exit(void);
 
 
@@ -972,16 +4405,28 @@ static int __init osprd_init(void)
 	(void) osp_spin_unlock;
 #endif
 
+	spin_lock_init(&mirror_config_lock);
+#ifdef CONFIG_X86
+	crc_hw = boot_cpu_has(X86_FEATURE_XMM4_2);
+#endif
+
 	/* Register the block device name. */
 	if (register_blkdev(OSPRD_MAJOR, "osprd") < 0) {
 		printk(KERN_WARNING "osprd: unable to get major number\n");
 		return -EBUSY;
 	}
 
+	/* Set up tracing and start the copy workers only now that the load
+	 * can't fail before osprd_exit() is there to undo them. */
+	setup_trace();
+	setup_copy_workers();
+
 	/* Initialize the device structures. */
 	for (i = r = 0; i < NOSPRD; i++)
 		if (setup_device(&osprds[i], i) < 0)
 			r = -EINVAL;
+	if (r == 0 && setup_stripe(&stripe) < 0)
+		r = -EINVAL;
 
 	if (r < 0) {
 		printk(KERN_EMERG "osprd: can't set up device structures\n");
@@ -998,9 +4443,17 @@ static int __init osprd_init(void)
 static void osprd_exit(void)
 {
 	int i;
+	/* Stop mirroring and wait for the copies in flight, which may write
+	 * to any device. */
+	for (i = 0; i < NOSPRD; i++)
+		osprds[i].mirror = NULL;
+	flush_scheduled_work();
+	cleanup_stripe(&stripe);
 	for (i = 0; i < NOSPRD; i++)
 		cleanup_device(&osprds[i]);
 	unregister_blkdev(OSPRD_MAJOR, "osprd");
+	cleanup_copy_workers();
+	cleanup_trace();
 }
 
 
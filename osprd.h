@@ -9,4 +9,310 @@
 #define OSPRDIOCNOTIFY		45
 #define OSPRDIOCSECTOR		46
 
+#define OSPRDIOCSETPOLICY	47
+#define OSPRDIOCTIMEDACQUIRE	48	// arg: timeout in milliseconds
+#define OSPRDIOCUPGRADE		49	// read lock -> write lock
+#define OSPRDIOCDOWNGRADE	50	// write lock -> read lock
+
+#define OSPRDIOCMULTIACQUIRE	51	// arg: struct osprd_multilock *
+#define OSPRDIOCMULTIRELEASE	52	// arg: struct osprd_multilock *
+
+#define OSPRDIOCFASTWAIT	53	// arg: 1 for a write lock, 0 for read
+#define OSPRDIOCFASTWAKE	54
+
+#define OSPRDIOCENQUEUE		55	// Queue a lock request without blocking;
+					// poll() for POLLIN to learn of the grant
+#define OSPRDIOCCANCEL		56	// Cancel a queued lock request
+
+#define OSPRDIOCRING		57	// arg: 0 or OSPRD_RING_PAYLOAD
+
+#define OSPRDIOCCHANGED		58	// arg: struct osprd_changes *
+
+#define OSPRDIOCMIRROR		59	// arg: mirror device index, or
+					// OSPRD_MIRROR_NONE
+#define OSPRDIOCMIRRORSTAT	60	// arg: struct osprd_mirror_stat *
+
+#define OSPRDIOCLOCKSTAT	61	// arg: struct osprd_lock_stat *
+#define OSPRDIOCCLASSACQUIRE	62	// arg: OSPRD_CLASS_*
+
+#define OSPRDIOCSNAPSHOT	63	// Read the disk as of now; see below
+
+#define OSPRDIOCSYNC		64	// arg: 1 to make writes to this file
+					// synchronous (the default), 0 to let
+					// the page cache batch them; fsync()
+					// flushes them
+
+#define OSPRDIOCTHROTTLE	65	// arg: struct osprd_throttle *
+#define OSPRDIOCTHROTTLESTAT	66	// arg: struct osprd_throttle *
+#define OSPRDIOCSCRUB		67	// arg: struct osprd_scrub *
+#define OSPRDIOCFASTSLOT	68	// Returns the file's slot in the shared
+					// lock page
+
+// Lock policies, passed as the argument to OSPRDIOCSETPOLICY
+#define OSPRD_POLICY_FIFO	0	// Grant strictly in ticket order
+#define OSPRD_POLICY_PHASEFAIR	1	// Admit all waiting readers between
+					// consecutive writers
+
+// Lock classes.  Waiting lock requests of a higher class are served
+// first, but every prio_aging_ms milliseconds (a module parameter) of
+// waiting count as one class more, so low classes can't starve.
+// OSPRDIOCCLASSACQUIRE names the class; other requests get
+// OSPRD_CLASS_HIGH if the process's nice value is negative, OSPRD_CLASS_LOW
+// if it is positive, and OSPRD_CLASS_NORMAL otherwise.  Under the
+// phase-fair policy, classes only order writers.
+#define OSPRD_CLASS_LOW		0
+#define OSPRD_CLASS_NORMAL	1
+#define OSPRD_CLASS_HIGH	2
+#define OSPRD_NCLASSES		3
+
+// Argument to OSPRDIOCLOCKSTAT: how waiting processes got the lock.  A
+// process whose turn is about to come spins for a few microseconds (the
+// spin_usecs module parameter) before going to sleep.
+struct osprd_lock_stat {
+	unsigned long long spin_acquires;	// Got it while spinning
+	unsigned long long sleep_acquires;	// Had to sleep
+	struct {
+		unsigned long long acquires;	// Locks granted by ticket
+		unsigned long long wait_usecs;	// Total time they waited
+		unsigned long long max_wait_usecs;// Longest wait
+	} classes[OSPRD_NCLASSES];		// Indexed by OSPRD_CLASS_*
+};
+
+// Argument to OSPRDIOCMULTIACQUIRE and OSPRDIOCMULTIRELEASE, which may be
+// issued on any ramdisk file.  Bit i stands for /dev/osprd('a' + i).  The
+// process must have a file open on every device in the set (otherwise
+// EBADF); closing that file releases the device's lock, as with
+// OSPRDIOCACQUIRE.
+struct osprd_multilock {
+	unsigned devices;	// Devices to lock or unlock
+	unsigned writers;	// Devices to write-lock (others are read-locked)
+};
+
+// The lock state of a ramdisk, shared with user space by mmap()ing one page
+// of a ramdisk file at offset OSPRD_MMAP_FASTLOCK.  Every lock, whether
+// taken by ioctl or in user space, is recorded in 'state', so uncontended
+// locks can be taken and released with atomic instructions alone; see
+// osprd_fast_lock() and osprd_fast_unlock() below.
+//
+// Like a robust futex, a lock taken in user space is also recorded against
+// the ramdisk file it was taken through, so that closing the file for the
+// last time (for instance because the process was killed) drops it.
+// OSPRDIOCFASTSLOT gives the file a slot: a write lock puts the slot in
+// 'state', and read locks are counted in 'holds[slot]'.
+#define OSPRD_FAST_SLOTS	64
+
+struct osprd_fastlock {
+	volatile int state;	// 0: unlocked; negative: write-locked, by
+				// OSPRD_FAST_OWNER(slot); otherwise the
+				// number of readers
+	volatile int waiters;	// Processes sleeping until 'state' changes
+	volatile int holds[OSPRD_FAST_SLOTS];	// Read locks taken through
+						// each slot's file
+};
+
+#define OSPRD_FAST_WRITER	(-1)	// Write-locked by ioctl
+#define OSPRD_FAST_OWNER(slot)	(OSPRD_FAST_WRITER - (slot))
+
+// mmap() offset of the shared lock page.  Smaller offsets map the disk
+// contents as usual.
+#define OSPRD_MMAP_FASTLOCK	0x40000000
+
+// Argument to OSPRDIOCCHANGED.  Every write to a ramdisk advances its
+// generation number; the ioctl reports which sectors were written after
+// generation 'since', so sync and backup tools need only copy those.
+// Pass the returned 'generation' as 'since' next time.  If 'nsectors' is
+// smaller than the disk, the ioctl fails with ENOSPC and sets 'nsectors'
+// to the number of sectors on the disk.
+struct osprd_changes {
+	unsigned long long since;	// in: last generation already copied
+	unsigned long long generation;	// out: current generation
+	unsigned nsectors;		// in: number of bits in 'bitmap'
+	unsigned char *bitmap;		// out: bit i (bitmap[i / 8] & 1 << i % 8)
+					// is set if sector i was written
+};
+
+// A change ring, set up on a ramdisk file with OSPRDIOCRING and then
+// mmap()ed at offset OSPRD_MMAP_RING.  Every sector written to the disk is
+// appended as one entry, so a subscriber can drain changes without system
+// calls; see osprd_ring_next() below.  Changes are numbered from 1, and
+// change 'seq' is stored in entries[seq % OSPRD_RING_ENTRIES].
+#define OSPRD_RING_ENTRIES	64
+#define OSPRD_RING_PAYLOAD	1	// Also copy the sector's new contents
+
+struct osprd_ring_entry {
+	volatile unsigned seq;	// Change number, or 0 while being written
+	unsigned sector;	// Sector that was written
+	unsigned char data[512];// Its contents, if OSPRD_RING_PAYLOAD
+};
+
+struct osprd_ring {
+	volatile unsigned head;	// Number of the next change
+	unsigned flags;		// Flags given to OSPRDIOCRING
+	struct osprd_ring_entry entries[OSPRD_RING_ENTRIES];
+};
+
+#define OSPRD_MMAP_RING		0x40100000
+
+// Mirroring.  After OSPRDIOCMIRROR with argument i, writes to the ramdisk
+// are copied to /dev/osprd('a' + i) in the background: the whole disk at
+// first, then every sector written since.  Writers never wait for the
+// copy, so the mirror may lag behind; OSPRDIOCMIRRORSTAT reports by how
+// much.
+#define OSPRD_MIRROR_NONE	(-1)	// Stop mirroring
+
+struct osprd_mirror_stat {
+	int mirror;			// Mirror device index, or
+					// OSPRD_MIRROR_NONE
+	unsigned lag;			// Sectors not yet copied to the mirror
+	unsigned long long copied;	// Sectors copied so far
+};
+
+// Snapshot reads.  After OSPRDIOCSNAPSHOT, read() on the file returns the
+// disk's contents as of the ioctl, whatever is written later.  A snapshot
+// is not a lock: writers proceed, and the kernel saves each sector's old
+// contents the first time it is overwritten, until the file is closed or
+// OSPRDIOCRELEASE drops the snapshot.  A file has at most one snapshot
+// (EBUSY).  If the kernel runs out of memory saving a sector, reads fail
+// with EIO.  Only read() sees the snapshot, not mmap() or splice().
+
+// Throttling.  OSPRDIOCTHROTTLE (on a file open for writing) limits how fast
+// process 'pid' may read() and write() the ramdisk; a process that goes over
+// its limit sleeps before its data is copied.  pid 0 sets the default, which
+// applies to every process without limits of its own; setting both limits
+// of a process to 0 returns it to the default.  Each process may run up to
+// 100 ms ahead of its rates.  OSPRDIOCTHROTTLESTAT fills in the limits in
+// effect for 'pid' and its counters; for pid 0, the counters are the
+// device's totals.  I/O through mmap(), splice() or aio is not throttled.
+struct osprd_throttle {
+	int pid;			// Process ID, or 0 for the default
+	unsigned bytes_per_sec;		// 0: unlimited
+	unsigned iops;			// read()s and write()s per second;
+					// 0: unlimited
+	unsigned long long throttled;	// out: calls that had to wait
+	unsigned long long delay_usecs;	// out: how long they waited in all
+};
+
+// Checksums.  A device loaded with its 'checksum' module parameter set keeps
+// a CRC32C of every sector, updated as the sector is written.  While the
+// 'verify_reads' parameter is set, reading a sector whose data no longer
+// matches its checksum fails with EIO.  OSPRDIOCSCRUB checks every sector,
+// on all CPUs at once, and reports how many are bad and up to
+// OSPRD_SCRUB_MAXBAD of them; it fails with EINVAL if the device keeps no
+// checksums.
+#define OSPRD_SCRUB_MAXBAD	64
+
+struct osprd_scrub {
+	unsigned long long checked;	// out: sectors checked
+	unsigned nbad;			// out: sectors that failed
+	unsigned bad[OSPRD_SCRUB_MAXBAD]; // out: the first min(nbad,
+					// OSPRD_SCRUB_MAXBAD) entries are
+					// failed sectors, in order
+};
+
+// Tracing.  While the 'trace' module parameter is set
+// (/sys/module/osprd/parameters/trace), every request and ioctl is recorded
+// in a buffer per CPU.  Reading /proc/osprdtrace drains the buffers as an
+// array of these events, one CPU's at a time; sort by 'usecs' to merge
+// them.  Requests are traced as the request function sees them, so the
+// pid is that of the process that happened to start the queue.
+#define OSPRD_TRACE_REQUEST	0	// A read or write request
+#define OSPRD_TRACE_IOCTL	1	// An ioctl
+#define OSPRD_TRACE_CLOSE	2	// The last close of a file
+#define OSPRD_TRACE_LOST	3	// 'arg' events were dropped because
+					// the buffer was full
+
+struct osprd_trace_event {
+	unsigned long long usecs;	// Time of the event, in microseconds
+	unsigned pid;			// Process that caused it
+	unsigned sector;		// Request: first sector
+	unsigned arg;			// Request: number of sectors; ioctl: its
+					// argument
+	unsigned char type;		// OSPRD_TRACE_*
+	unsigned char dev;		// Device: 0 for /dev/osprda, ...
+	unsigned char cmd;		// ioctl: its number
+	unsigned char write;		// Request: 1 for a write; others: 1 if
+					// the file was open for writing
+};
+
+#ifndef __KERNEL__
+#include <sys/ioctl.h>
+
+// Get the slot of ramdisk file 'fd' in the shared lock page.  Returns the
+// slot, or -1 (EBUSY if every slot is taken).
+static inline int osprd_fast_slot(int fd)
+{
+	return ioctl(fd, OSPRDIOCFASTSLOT, 0);
+}
+
+// Try to take the lock in user space through the file holding 'slot'.
+// Readers defer to sleeping waiters so that writers aren't starved.
+// Returns 1 on success.
+static inline int osprd_fast_trylock(struct osprd_fastlock *l, int slot,
+				     int writer)
+{
+	int state = l->state;
+	if (writer)
+		return state == 0 && __sync_bool_compare_and_swap(&l->state,
+			0, OSPRD_FAST_OWNER(slot));
+	if (state < 0 || l->waiters != 0
+	    || !__sync_bool_compare_and_swap(&l->state, state, state + 1))
+		return 0;
+	__sync_fetch_and_add(&l->holds[slot], 1);
+	return 1;
+}
+
+// Take the lock, sleeping in the kernel only if it is contended.
+// 'fd' is the ramdisk file 'l' was mapped from, and 'slot' its slot.
+// Returns 0 or -1.  Fast-path locks are released when the file is closed
+// for the last time.
+static inline int osprd_fast_lock(int fd, struct osprd_fastlock *l,
+				  int slot, int writer)
+{
+	if (osprd_fast_trylock(l, slot, writer))
+		return 0;
+	return ioctl(fd, OSPRDIOCFASTWAIT, (unsigned long) writer);
+}
+
+// Release a lock taken with osprd_fast_lock(), waking sleepers if any.
+static inline void osprd_fast_unlock(int fd, struct osprd_fastlock *l,
+				     int slot, int writer)
+{
+	if (writer)
+		__sync_lock_release(&l->state);
+	else {
+		__sync_fetch_and_sub(&l->holds[slot], 1);
+		__sync_fetch_and_sub(&l->state, 1);
+	}
+	__sync_synchronize();
+	if (l->waiters != 0)
+		ioctl(fd, OSPRDIOCFASTWAKE, 0);
+}
+
+// Copy change number *seq (start with 1) out of 'ring' into *e.  Returns 1
+// and advances *seq if the change was read; 0 if it hasn't happened yet;
+// or -1 if it was overwritten before it could be read, in which case *seq
+// is moved up to the oldest change still in the ring.
+static inline int osprd_ring_next(struct osprd_ring *ring, unsigned *seq,
+				  struct osprd_ring_entry *e)
+{
+	struct osprd_ring_entry *slot =
+		&ring->entries[*seq % OSPRD_RING_ENTRIES];
+	unsigned head = ring->head;
+
+	if ((int) (head - *seq) <= 0)
+		return 0;
+	if ((int) (head - *seq) <= OSPRD_RING_ENTRIES) {
+		__sync_synchronize();
+		*e = *slot;
+		__sync_synchronize();
+		if (e->seq == *seq && slot->seq == *seq) {
+			(*seq)++;
+			return 1;
+		}
+	}
+	*seq = ring->head - OSPRD_RING_ENTRIES;
+	return -1;
+}
+#endif
+
 #endif
@@ -1,11 +1,19 @@
+#define _GNU_SOURCE		/* splice() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sched.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "osprd.h"
@@ -17,6 +25,32 @@ Reads from or writes to an OSP ramdisk device.\n\
 Usage: ./osprdaccess -w [SIZE] [OPTIONS] [DEVICE...] < DATA\n\
    or: ./osprdaccess -w [SIZE] -z [DEVICE...]        (writes zeros)\n\
    or: ./osprdaccess -r [SIZE] [OPTIONS] [DEVICE...] > DATA\n\
+   or: ./osprdaccess -c GEN [OPTIONS] [DEVICE...]\n\
+       (prints the current generation, then the sectors written since\n\
+       generation GEN, one per line)\n\
+   or: ./osprdaccess -m MIRROR [OPTIONS] [DEVICE...]\n\
+       (mirrors the device onto /dev/osprdMIRROR, where MIRROR is a\n\
+       letter a-d; \"none\" stops mirroring)\n\
+   or: ./osprdaccess -s [OPTIONS] [DEVICE...]\n\
+       (prints the device's mirror, how many sectors it lags behind, how\n\
+       many waiting lock requests were granted while spinning or after\n\
+       sleeping, and the default throttling limits and how often they\n\
+       held processes back)\n\
+   or: ./osprdaccess -q BYTES CALLS [PID] [OPTIONS] [DEVICE...]\n\
+       (limits process PID, or by default every process, to BYTES bytes\n\
+       and CALLS reads or writes per second on the device; 0 means no\n\
+       limit)\n\
+   or: ./osprdaccess -k [OPTIONS] [DEVICE...]\n\
+       (checks every sector against its checksum and prints how many were\n\
+       checked and how many failed, then the failed sectors, one per line;\n\
+       the exit status is 1 if any failed)\n\
+   or: ./osprdaccess [-T] -x SCRIPT\n\
+       (runs the operations in SCRIPT, or stdin if SCRIPT is -, in one\n\
+       process; see below)\n\
+   or: ./osprdaccess [-C CPU] -K BYTES SECONDS\n\
+       (walks a BYTES-byte buffer in random order for SECONDS seconds and\n\
+       prints the average nanoseconds per access: a measure of how much of\n\
+       the CPU cache other work leaves it)\n\
    SIZE is the number of bytes to read/write.  Default is whole file.\n\
    Options are:\n\
    -o OFF\n\
@@ -27,15 +61,71 @@ Usage: ./osprdaccess -w [SIZE] [OPTIONS] [DEVICE...] < DATA\n\
    -L [DELAY]\n\
        Attempt to lock the ramdisk without blocking.  This is like -l, but if\n\
        -l would block, -L will return a \"resource busy\" error instead.\n\
+   -S [DELAY]\n\
+       Read from a snapshot of the ramdisk taken after opening it, instead\n\
+       of locking it.  Writers are not held up, and their writes aren't\n\
+       seen.  DELAY is as for -l.\n\
+   -t TIMEOUT\n\
+       With -l, wait at most TIMEOUT seconds for the lock, then give up with\n\
+       a \"timed out\" error.\n\
+   -p CLASS\n\
+       With -l, queue for the lock in class CLASS: \"low\", \"normal\" or\n\
+       \"high\".  Higher classes are served first.  By default the class\n\
+       follows the process's nice value.\n\
+   -a\n\
+       With -l, queue the lock request without blocking and wait for it to\n\
+       be granted with poll().\n\
+   -f\n\
+       With -l or -L, lock through the ramdisk's shared lock page, so an\n\
+       uncontended lock costs no system calls.  The device is opened for\n\
+       reading and writing to map the page.\n\
+   -Z\n\
+       Move data between the device and stdin or stdout inside the kernel\n\
+       (copy_file_range, splice or sendfile, whichever works), falling\n\
+       back to read and write.\n\
+   -W\n\
+       Let the page cache collect writes instead of writing synchronously,\n\
+       and fsync() the device once all data is written.\n\
+   -b BYTES\n\
+       Read or write BYTES (at most 1048576) per system call.\n\
+   -D\n\
+       Bypass the page cache (O_DIRECT), so each system call reaches the\n\
+       driver as one request of up to 1 MB.  Sizes and offsets must be\n\
+       multiples of 512.\n\
+   -C CPU\n\
+       Run on CPU number CPU only.\n\
+   -R\n\
+       Time each read() or write() of the device, and report the median,\n\
+       99th percentile and longest times on stderr.\n\
+   -T\n\
+       Report the transfer method and throughput on stderr.  With -x,\n\
+       report the time each operation took.\n\
    -d DELAY\n\
        Wait DELAY seconds before reading/writing (but after locking).\n\
    -n [SECTOR]\n\
        Request a change notification.  SECTOR, if given, is the sector of\n\
        the disk to request a notification for.  The value of SECTOR must be\n\
        between 1 and 32, inclusive.\n\
+   -P POLICY\n\
+       Set the ramdisk's lock policy before locking.  POLICY is \"fifo\"\n\
+       (grant locks in arrival order) or \"phasefair\" (admit all waiting\n\
+       readers at once between writers).\n\
    DEVICE is the device to read/write.  The default is /dev/osprda.\n\
    You can also give more than one device name.  All devices are opened, but\n\
-   only the last device is read or written.\n");
+   only the last device is read or written.\n\
+   A SCRIPT has one operation per line, applied to the device opened last:\n\
+       open DEVICE [r|w|rw]   close\n\
+       lock   trylock   release   upgrade   downgrade   snapshot\n\
+       lockall DEVS [WDEVS]   releaseall DEVS\n\
+           (lock or unlock several devices at once; DEVS are letters a-d,\n\
+           each open in the script, and WDEVS those to write-lock)\n\
+       enqueue   wait   cancel     (queue a lock request, poll for it)\n\
+       notify [SECTOR]\n\
+       seek OFF   read SIZE   write TEXT\n\
+       sleep SECONDS\n\
+       repeat N OPERATION\n\
+   Read data goes to stdout.  A failed operation is reported on stderr, and\n\
+   the script goes on; the exit status is 1 if any operation failed.\n");
 	exit(status);
 }
 
@@ -78,25 +168,447 @@ void sleep_for(double seconds)
 	}
 }
 
-void transfer(int fd1, int fd2, ssize_t size)
+// Walk 'size' bytes of memory, one cache line at a time in a random cycle,
+// for 'seconds' seconds, and print the average time per access.
+#define CACHELINE 64
+int cache_probe(ssize_t size, double seconds)
 {
-	char buf[BUFSIZ], *bufptr;
+	size_t n = size / CACHELINE, i, j, k, t, steps = 0;
+	size_t *lines;
+	struct timeval start, now, end, delta;
+
+	if (n < 2 || posix_memalign((void **) &lines, 4096, n * CACHELINE)) {
+		fprintf(stderr, "cache probe: bad size\n");
+		return 1;
+	}
+	// Link the lines into a single random cycle (Sattolo's algorithm),
+	// so the hardware prefetcher can't guess the next one
+	for (i = 0; i < n; i++)
+		lines[i * (CACHELINE / sizeof(size_t))] = i;
+	for (i = n - 1; i > 0; i--) {
+		j = random() % i;
+		t = lines[i * (CACHELINE / sizeof(size_t))];
+		lines[i * (CACHELINE / sizeof(size_t))] =
+			lines[j * (CACHELINE / sizeof(size_t))];
+		lines[j * (CACHELINE / sizeof(size_t))] = t;
+	}
+
+	gettimeofday(&start, 0);
+	delta.tv_sec = (long) seconds;
+	delta.tv_usec = (int) ((seconds - delta.tv_sec) * 1000000);
+	timeradd(&start, &delta, &end);
+	k = 0;
+	do {
+		for (i = 0; i < 1000000; i++)
+			k = lines[k * (CACHELINE / sizeof(size_t))];
+		steps += i;
+		gettimeofday(&now, 0);
+	} while (timercmp(&now, &end, <));
+
+	timersub(&now, &start, &delta);
+	printf("%.2f ns per access (%lu accesses, ended at line %lu)\n",
+	       (delta.tv_sec * 1e9 + delta.tv_usec * 1e3) / steps,
+	       (unsigned long) steps, (unsigned long) k);
+	free(lines);
+	return 0;
+}
+
+// Locks taken with -f.  Closing the file would release them too, but
+// release them explicitly at exit.
+#define MAXFASTLOCKS 16
+struct fastlock_entry {
+	int fd;
+	struct osprd_fastlock *lock;
+	int slot;
+	int writer;
+} fastlocks[MAXFASTLOCKS];
+int nfastlocks = 0;
+
+void release_fast_locks(void)
+{
+	while (nfastlocks > 0) {
+		struct fastlock_entry *e = &fastlocks[--nfastlocks];
+		osprd_fast_unlock(e->fd, e->lock, e->slot, e->writer);
+	}
+}
+
+// Lock 'devfd' through its shared lock page.  Returns 0 or -1.
+int fast_lock(int devfd, int writer, int trylock)
+{
+	struct osprd_fastlock *l;
+	int slot;
+
+	if (nfastlocks == MAXFASTLOCKS) {
+		errno = ENOMEM;
+		return -1;
+	}
+	l = mmap(NULL, sizeof(*l), PROT_READ | PROT_WRITE, MAP_SHARED,
+		 devfd, OSPRD_MMAP_FASTLOCK);
+	if (l == MAP_FAILED || (slot = osprd_fast_slot(devfd)) == -1)
+		return -1;
+	if (trylock && !osprd_fast_trylock(l, slot, writer)) {
+		errno = EBUSY;
+		return -1;
+	} else if (!trylock && osprd_fast_lock(devfd, l, slot, writer) == -1)
+		return -1;
+
+	fastlocks[nfastlocks].fd = devfd;
+	fastlocks[nfastlocks].lock = l;
+	fastlocks[nfastlocks].slot = slot;
+	fastlocks[nfastlocks].writer = writer;
+	if (nfastlocks++ == 0)
+		atexit(release_fast_locks);
+	return 0;
+}
+
+// Queue a lock request on 'devfd' and wait in poll() until it is granted.
+// Returns 0 or -1.
+int async_lock(int devfd)
+{
+	struct pollfd pfd;
+
+	if (ioctl(devfd, OSPRDIOCENQUEUE, NULL) == 0)
+		return 0;
+	else if (errno != EINPROGRESS)
+		return -1;
+
+	pfd.fd = devfd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, -1) == -1)
+		if (errno != EINTR)
+			return -1;
+	return 0;
+}
+
+// Parse a string of device letters, such as "ab", into a bitmask in
+// *devices.  Returns 1 on success.
+int parse_devices(const char *arg, unsigned *devices)
+{
+	*devices = 0;
+	for (; *arg; arg++) {
+		if (*arg < 'a' || *arg > 'd')
+			return 0;
+		*devices |= 1U << (*arg - 'a');
+	}
+	return *devices != 0;
+}
+
+// Scripted mode (-x).  Devices opened by the script, the last one current.
+#define MAXSCRIPTFDS 16
+int script_fds[MAXSCRIPTFDS];
+int nscript_fds = 0;
+
+// Run one script operation 'op' with arguments 'args' (the rest of the
+// line, or NULL).  Returns 0, or -1 with errno set.
+int script_op(const char *op, char *args)
+{
+	int fd = nscript_fds ? script_fds[nscript_fds - 1] : -1;
+	char buf[BUFSIZ], words[BUFSIZ], *arg = NULL;
+	ssize_t n, r;
+	double d;
+
+	// Split a copy of the arguments into words; "write" uses 'args'.
+	if (args) {
+		strcpy(words, args);
+		arg = strtok(words, " \t");
+	}
+
+	if (strcmp(op, "open") == 0) {
+		int mode = O_RDONLY;
+		char *how = strtok(NULL, " \t");
+		if (!arg || nscript_fds == MAXSCRIPTFDS)
+			return errno = EINVAL, -1;
+		if (how && strcmp(how, "w") == 0)
+			mode = O_WRONLY;
+		else if (how && strcmp(how, "rw") == 0)
+			mode = O_RDWR;
+		if ((fd = open(arg, mode)) == -1)
+			return -1;
+		script_fds[nscript_fds++] = fd;
+		return 0;
+	} else if (strcmp(op, "sleep") == 0) {
+		if (!arg || !parse_double(arg, &d))
+			return errno = EINVAL, -1;
+		sleep_for(d);
+		return 0;
+	} else if (fd == -1)
+		return errno = EBADF, -1;
+
+	if (strcmp(op, "close") == 0) {
+		nscript_fds--;
+		return close(fd);
+	} else if (strcmp(op, "lock") == 0)
+		return ioctl(fd, OSPRDIOCACQUIRE, NULL);
+	else if (strcmp(op, "trylock") == 0)
+		return ioctl(fd, OSPRDIOCTRYACQUIRE, NULL);
+	else if (strcmp(op, "snapshot") == 0)
+		return ioctl(fd, OSPRDIOCSNAPSHOT, NULL);
+	else if (strcmp(op, "lockall") == 0 || strcmp(op, "releaseall") == 0) {
+		struct osprd_multilock m;
+		char *w = strtok(NULL, " \t");
+		if (!arg || !parse_devices(arg, &m.devices)
+		    || (w && !parse_devices(w, &m.writers)))
+			return errno = EINVAL, -1;
+		if (!w)
+			m.writers = 0;
+		return ioctl(fd, strcmp(op, "lockall") == 0
+			     ? OSPRDIOCMULTIACQUIRE : OSPRDIOCMULTIRELEASE, &m);
+	}
+	else if (strcmp(op, "release") == 0)
+		return ioctl(fd, OSPRDIOCRELEASE, NULL);
+	else if (strcmp(op, "upgrade") == 0)
+		return ioctl(fd, OSPRDIOCUPGRADE, NULL);
+	else if (strcmp(op, "downgrade") == 0)
+		return ioctl(fd, OSPRDIOCDOWNGRADE, NULL);
+	else if (strcmp(op, "enqueue") == 0) {
+		if (ioctl(fd, OSPRDIOCENQUEUE, NULL) == -1
+		    && errno != EINPROGRESS)
+			return -1;
+		return 0;
+	} else if (strcmp(op, "wait") == 0) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, -1) == -1)
+			if (errno != EINTR)
+				return -1;
+		return 0;
+	} else if (strcmp(op, "cancel") == 0)
+		return ioctl(fd, OSPRDIOCCANCEL, NULL);
+	else if (strcmp(op, "notify") == 0) {
+		n = 1;
+		if (arg && (!parse_ssize(arg, &n) || n < 1 || n > 32))
+			return errno = EINVAL, -1;
+		return ioctl(fd, OSPRDIOCNOTIFY, n);
+	} else if (strcmp(op, "seek") == 0) {
+		if (!arg || !parse_ssize(arg, &n))
+			return errno = EINVAL, -1;
+		if (lseek(fd, n, SEEK_SET) == (off_t) -1)
+			return -1;
+		ioctl(fd, OSPRDIOCSECTOR, (unsigned long) n);
+		return 0;
+	} else if (strcmp(op, "read") == 0) {
+		if (!arg || !parse_ssize(arg, &n) || n < 0)
+			return errno = EINVAL, -1;
+		while (n > 0) {
+			r = read(fd, buf, n < BUFSIZ ? n : BUFSIZ);
+			if (r <= 0)
+				return r;
+			fwrite(buf, 1, r, stdout);
+			n -= r;
+		}
+		return 0;
+	} else if (strcmp(op, "write") == 0) {
+		// The text is the rest of the line, spaces and all.
+		n = args ? strlen(args) : 0;
+		return write(fd, args, n) == n ? 0 : -1;
+	} else if (strcmp(op, "repeat") == 0) {
+		char *rest = strtok(NULL, "");
+		char *sub, copy[BUFSIZ];
+		if (!arg || !parse_ssize(arg, &n) || !rest)
+			return errno = EINVAL, -1;
+		while (n-- > 0) {
+			strcpy(copy, rest);
+			sub = strtok(copy, " \t");
+			if (script_op(sub, strtok(NULL, "")) == -1)
+				return -1;
+		}
+		return 0;
+	} else
+		return errno = EINVAL, -1;
+}
+
+// Run the script in 'f'.  If 'timing', print each operation's duration on
+// stderr.  Returns 0 if every operation succeeded, 1 otherwise.
+int run_script(FILE *f, int timing)
+{
+	char line[BUFSIZ], *op, *args;
+	struct timeval start, end;
+	int lineno = 0, status = 0, r;
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		line[strcspn(line, "\n")] = 0;
+		op = strtok(line, " \t");
+		if (!op || op[0] == '#')
+			continue;
+		args = strtok(NULL, "");
+
+		gettimeofday(&start, 0);
+		r = script_op(op, args);
+		gettimeofday(&end, 0);
+		fflush(stdout);
+
+		if (r == -1) {
+			fprintf(stderr, "line %d: %s: %s\n", lineno, op,
+				strerror(errno));
+			status = 1;
+		}
+		if (timing) {
+			timersub(&end, &start, &end);
+			fprintf(stderr, "%s: %ld us\n", op,
+				end.tv_sec * 1000000L + end.tv_usec);
+		}
+	}
+	return status;
+}
+
+// Print the generation of 'devfd', then the sectors written since 'since'.
+void print_changes(int devfd, unsigned long long since)
+{
+	struct osprd_changes c;
+	unsigned i;
+
+	c.since = since;
+	c.nsectors = 0;
+	c.bitmap = NULL;
+	while (ioctl(devfd, OSPRDIOCCHANGED, &c) == -1) {
+		if (errno != ENOSPC) {
+			perror("ioctl OSPRDIOCCHANGED");
+			exit(1);
+		}
+		free(c.bitmap);
+		c.bitmap = calloc((c.nsectors + 7) / 8, 1);
+		if (!c.bitmap) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+
+	printf("%llu\n", c.generation);
+	for (i = 0; i < c.nsectors; i++)
+		if (c.bitmap[i / 8] & (1 << (i % 8)))
+			printf("%u\n", i);
+	free(c.bitmap);
+}
+
+const char *class_names[OSPRD_NCLASSES] = { "low", "normal", "high" };
+
+// Print the mirroring state and lock statistics of 'devfd'.
+void print_status(int devfd)
+{
+	struct osprd_mirror_stat st;
+	struct osprd_lock_stat lst;
+	struct osprd_throttle t;
+	int i;
+
+	if (ioctl(devfd, OSPRDIOCMIRRORSTAT, &st) == -1) {
+		perror("ioctl OSPRDIOCMIRRORSTAT");
+		exit(1);
+	}
+	if (st.mirror == OSPRD_MIRROR_NONE)
+		printf("mirror: none\n");
+	else
+		printf("mirror: %c\n", 'a' + st.mirror);
+	printf("lag: %u\ncopied: %llu\n", st.lag, st.copied);
+
+	if (ioctl(devfd, OSPRDIOCLOCKSTAT, &lst) == -1) {
+		perror("ioctl OSPRDIOCLOCKSTAT");
+		exit(1);
+	}
+	printf("spin acquires: %llu\nsleep acquires: %llu\n",
+	       lst.spin_acquires, lst.sleep_acquires);
+	for (i = 0; i < OSPRD_NCLASSES; i++)
+		printf("class %s: %llu acquires, %llu us average wait, "
+		       "%llu us longest wait\n", class_names[i],
+		       lst.classes[i].acquires,
+		       lst.classes[i].acquires ? lst.classes[i].wait_usecs
+		       / lst.classes[i].acquires : 0,
+		       lst.classes[i].max_wait_usecs);
+
+	memset(&t, 0, sizeof(t));
+	if (ioctl(devfd, OSPRDIOCTHROTTLESTAT, &t) == -1) {
+		perror("ioctl OSPRDIOCTHROTTLESTAT");
+		exit(1);
+	}
+	printf("throttle: %u bytes/s, %u calls/s\n"
+	       "throttled: %llu calls, %llu us\n", t.bytes_per_sec, t.iops,
+	       t.throttled, t.delay_usecs);
+}
+
+// Largest unit of I/O that -b accepts: the largest request the driver
+// takes
+#define MAXIOUNIT	1048576
+
+// Bytes moved per read() or write() by transfer() and transfer_zero()
+ssize_t io_unit = BUFSIZ;
+
+// With -R, the time each read() or write() of latency_fd took, in
+// nanoseconds
+int latency_fd = -1;
+unsigned long long *latencies;
+size_t nlatencies = 0, latency_cap = 0;
+
+// read() or write() 'n' bytes of 'buf' on 'fd', timing the call if 'fd'
+// is latency_fd.
+ssize_t timed_io(int dowrite, int fd, char *buf, size_t n)
+{
+	struct timespec t0, t1;
+	ssize_t r;
+
+	if (fd != latency_fd)
+		return dowrite ? write(fd, buf, n) : read(fd, buf, n);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	r = dowrite ? write(fd, buf, n) : read(fd, buf, n);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (r > 0) {
+		if (nlatencies == latency_cap) {
+			latency_cap = latency_cap ? latency_cap * 2 : 1024;
+			latencies = realloc(latencies,
+					    latency_cap * sizeof(*latencies));
+			if (!latencies) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		latencies[nlatencies++] = (t1.tv_sec - t0.tv_sec) * 1000000000ULL
+			+ t1.tv_nsec - t0.tv_nsec;
+	}
+	return r;
+}
+
+int compare_latencies(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+void print_latencies(void)
+{
+	if (nlatencies == 0)
+		return;
+	qsort(latencies, nlatencies, sizeof(*latencies), compare_latencies);
+	fprintf(stderr, "%lu calls: median %.1f us, 99th percentile %.1f us, "
+		"longest %.1f us\n", (unsigned long) nlatencies,
+		latencies[nlatencies / 2] / 1000.0,
+		latencies[nlatencies * 99 / 100] / 1000.0,
+		latencies[nlatencies - 1] / 1000.0);
+}
+
+// Copy 'size' bytes (all if negative) from fd1 to fd2 through a buffer.
+// Returns the number of bytes copied.
+ssize_t transfer(int fd1, int fd2, ssize_t size)
+{
+	static char buf[MAXIOUNIT] __attribute__((aligned(4096)));
+	char *bufptr;
+	ssize_t total = 0;
 
 	while (size != 0) {
-		ssize_t r = read(fd1, buf, (size > 0 && size < BUFSIZ ? size : BUFSIZ));
+		ssize_t r = timed_io(0, fd1, buf, (size > 0 && size < io_unit ? size : io_unit));
 		if (r < 0 && (errno == EAGAIN || errno == EINTR))
 			continue;
 		else if (r < 0) {
 			perror("read");
 			exit(1);
 		} else if (r == 0)
-			return;
+			return total;
 		else
 			size -= r;
 
 		bufptr = buf;
 		while (r > 0) {
-			ssize_t w = write(fd2, bufptr, r);
+			ssize_t w = timed_io(1, fd2, bufptr, r);
 			if (w < 0 && (errno == EAGAIN || errno == EINTR))
 				continue;
 			else if (w < 0 && errno == ENOSPC) /* end of file */
@@ -105,18 +617,122 @@ void transfer(int fd1, int fd2, ssize_t size)
 				perror("write");
 				exit(1);
 			} else
-				bufptr += w, r -= w;
+				bufptr += w, r -= w, total += w;
 		}
 	}
+	return total;
 }
 
-void transfer_zero(int fd2, ssize_t size)
+// Zero-copy transfer methods.  Between two files that aren't pipes, they
+// are tried in order up to ZC_NONE; ZC_SPLICE is for when one is a pipe.
+#define ZC_COPY_RANGE	0	// copy_file_range(fd1, fd2)
+#define ZC_SENDFILE	1	// sendfile(fd2, fd1)
+#define ZC_SPLICE_PIPE	2	// splice(fd1, pipe), then splice(pipe, fd2)
+#define ZC_NONE		3	// read() and write()
+#define ZC_SPLICE	4	// splice(fd1, fd2)
+const char *zc_names[] = {
+	"copy_file_range", "sendfile", "splice via pipe", "read/write", "splice"
+};
+#define ZC_CHUNK	(1 << 20)
+
+// Move up to 'n' bytes from fd1 to fd2 with 'method'.  'p' is a pipe for
+// ZC_SPLICE_PIPE.  Returns the number of bytes moved, 0 at end of file, or
+// -1 with errno set.
+ssize_t zerocopy_chunk(int method, int fd1, int fd2, size_t n, int p[2])
 {
-	char buf[BUFSIZ];
-	memset(buf, '\0', BUFSIZ);
+	ssize_t r, w, left;
+
+	switch (method) {
+	case ZC_COPY_RANGE:
+#ifdef __NR_copy_file_range
+		return syscall(__NR_copy_file_range, fd1, NULL, fd2, NULL, n, 0);
+#else
+		errno = ENOSYS;
+		return -1;
+#endif
+	case ZC_SPLICE:
+		return splice(fd1, NULL, fd2, NULL, n, SPLICE_F_MOVE);
+	case ZC_SENDFILE:
+		return sendfile(fd2, fd1, NULL, n);
+	default:
+		r = splice(fd1, NULL, p[1], NULL, n, SPLICE_F_MOVE);
+		for (left = r; left > 0; left -= w) {
+			w = splice(p[0], NULL, fd2, NULL, left, SPLICE_F_MOVE);
+			if (w < 0 && errno == EINTR)
+				w = 0;
+			else if (w <= 0) {
+				// The data is already in the pipe, so finish
+				// with read() and write().
+				transfer(p[0], fd2, left);
+				break;
+			}
+		}
+		return r;
+	}
+}
+
+// Copy 'size' bytes (all if negative) from fd1 to fd2 without passing the
+// data through user space, if the kernel can.  A method that fails with
+// EINVAL or the like is dropped for the next one; if none works, the rest
+// is copied with transfer().  Sets *method to the last method used and
+// returns the number of bytes copied.
+ssize_t transfer_zerocopy(int fd1, int fd2, ssize_t size, int *method)
+{
+	struct stat st1, st2;
+	int p[2] = { -1, -1 };
+	ssize_t r, total = 0;
+	size_t n;
+
+	if (fstat(fd1, &st1) == 0 && fstat(fd2, &st2) == 0
+	    && (S_ISFIFO(st1.st_mode) || S_ISFIFO(st2.st_mode)))
+		*method = ZC_SPLICE;
+	else
+		*method = ZC_COPY_RANGE;
+
+	while (size != 0 && *method != ZC_NONE) {
+		n = (size > 0 && size < ZC_CHUNK ? size : ZC_CHUNK);
+		if (*method == ZC_SPLICE_PIPE && p[0] < 0 && pipe(p) == -1) {
+			*method = ZC_NONE;
+			break;
+		}
+		r = zerocopy_chunk(*method, fd1, fd2, n, p);
+		if (r > 0) {
+			total += r;
+			if (size > 0)
+				size -= r;
+		} else if (r == 0)
+			break;
+		else if (errno == EINTR || errno == EAGAIN)
+			continue;
+		else if (errno == ENOSPC) /* end of file */
+			break;
+		else if (errno == EINVAL || errno == ENOSYS || errno == EXDEV
+			 || errno == EOPNOTSUPP || errno == EBADF
+			 || errno == ESPIPE) {
+			if (*method == ZC_SPLICE)
+				*method = ZC_NONE;
+			else
+				(*method)++;
+		} else {
+			perror(zc_names[*method]);
+			exit(1);
+		}
+	}
+
+	if (*method == ZC_NONE)
+		total += transfer(fd1, fd2, size);
+	if (p[0] >= 0)
+		close(p[0]), close(p[1]);
+	return total;
+}
+
+ssize_t transfer_zero(int fd2, ssize_t size)
+{
+	static char buf[MAXIOUNIT] __attribute__((aligned(4096)));
+	ssize_t total = 0;
 
 	while (size != 0) {
-		ssize_t w = write(fd2, buf, (size > 0 && size < BUFSIZ ? size : BUFSIZ));
+		ssize_t w = timed_io(1, fd2, buf, (size > 0 && size < io_unit ? size : io_unit));
 		if (w < 0 && (errno == EAGAIN || errno == EINTR))
 			continue;
 		else if (w < 0 && errno == ENOSPC) /* end of file */
@@ -125,23 +741,42 @@ void transfer_zero(int fd2, ssize_t size)
 			perror("write");
 			exit(1);
 		} else
-			size -= w;
+			size -= w, total += w;
 	}
+	return total;
 }
 
 int main(int argc, char *argv[])
 {
 	char *newarg;
 	int devfd, ofd;
-	int i, r, timeout = 0, zero = 0;
-	int mode = O_RDONLY, dolock = 0, dotrylock = 0;
+	int i, r, zero = 0;
+	int mode = O_RDONLY, dolock = 0, dotrylock = 0, dofast = 0;
+	int doasync = 0, dochanges = 0, domirror = 0, dostat = 0;
+	int dosnapshot = 0, dowriteback = 0, dodirect = 0, dothrottle = 0;
+	int doscrub = 0, dolatency = 0;
+	struct osprd_scrub scrub;
+	struct osprd_throttle throttle;
+	int dozerocopy = 0, dotiming = 0, method = ZC_NONE;
+	struct timeval start, end;
+	ssize_t moved;
+	double secs;
+	const char *script = NULL;
+	ssize_t probe_size = 0;
+	double probe_secs = 0;
+	FILE *scriptf;
+	int mirror = OSPRD_MIRROR_NONE;
+	ssize_t since = 0;
 	ssize_t size = -1;
 	ssize_t offset = 0;
 	double delay = 0;
 	double lock_delay = 0;
+	double lock_timeout = -1;
 	const char *devname = "/dev/osprda";
 	int notif = 0;
 	ssize_t sector = 1;
+	int policy = -1;
+	int lock_class = -1;
 
  flag:
 	// Detect a change notification option
@@ -171,6 +806,87 @@ int main(int argc, char *argv[])
 		goto flag;
 	}
 
+	// Detect a changed-sectors query
+	if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+		if (argc < 3 || !parse_ssize(argv[2], &since) || since < 0)
+			usage(1);
+		dochanges = 1;
+		mode = O_RDONLY;
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a mirror option
+	if (argc >= 2 && strcmp(argv[1], "-m") == 0) {
+		if (argc < 3)
+			usage(1);
+		if (strcmp(argv[2], "none") == 0)
+			mirror = OSPRD_MIRROR_NONE;
+		else if (argv[2][0] >= 'a' && argv[2][0] <= 'd'
+			 && argv[2][1] == 0)
+			mirror = argv[2][0] - 'a';
+		else
+			usage(1);
+		domirror = 1;
+		mode = O_WRONLY;
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+		dostat = 1;
+		argv++, argc--;
+		goto flag;
+	} else if (argc >= 2 && strcmp(argv[1], "-k") == 0) {
+		doscrub = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a throttling option
+	if (argc >= 2 && strcmp(argv[1], "-q") == 0) {
+		ssize_t bps, iops, pid = 0;
+		if (argc < 4 || !parse_ssize(argv[2], &bps) || bps < 0
+		    || !parse_ssize(argv[3], &iops) || iops < 0)
+			usage(1);
+		argv += 3, argc -= 3;
+		if (argc >= 2 && parse_ssize(argv[1], &pid))
+			argv++, argc--;
+		throttle.pid = pid;
+		throttle.bytes_per_sec = bps;
+		throttle.iops = iops;
+		dothrottle = 1;
+		mode = O_WRONLY;
+		goto flag;
+	}
+
+	// Detect transfer options
+	if (argc >= 2 && strcmp(argv[1], "-Z") == 0) {
+		dozerocopy = 1;
+		argv++, argc--;
+		goto flag;
+	} else if (argc >= 2 && strcmp(argv[1], "-T") == 0) {
+		dotiming = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a script
+	if (argc >= 2 && strcmp(argv[1], "-x") == 0) {
+		if (argc < 3)
+			usage(1);
+		script = argv[2];
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a cache probe
+	if (argc >= 2 && strcmp(argv[1], "-K") == 0) {
+		if (argc < 4 || !parse_ssize(argv[2], &probe_size)
+		    || probe_size <= 0 || !parse_double(argv[3], &probe_secs))
+			usage(1);
+		argv += 3, argc -= 3;
+		goto flag;
+	}
+
 	// Detect an offset
 	if (argc >= 2 && strcmp(argv[1], "-o") == 0) {
 		if (argc < 2 || !parse_ssize(argv[2], &offset))
@@ -199,6 +915,115 @@ int main(int argc, char *argv[])
 		goto flag;
 	}
 
+	// Detect a snapshot option
+	if (argc >= 2 && strcmp(argv[1], "-S") == 0) {
+		dosnapshot = 1;
+		argv++, argc--;
+		if (argc >= 2 && parse_double(argv[1], &lock_delay))
+			argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a lock timeout option
+	if (argc >= 2 && strcmp(argv[1], "-t") == 0) {
+		if (argc < 3 || !parse_double(argv[2], &lock_timeout)
+		    || lock_timeout < 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a lock policy option
+	if (argc >= 2 && strcmp(argv[1], "-P") == 0) {
+		if (argc < 3)
+			usage(1);
+		else if (strcmp(argv[2], "fifo") == 0)
+			policy = OSPRD_POLICY_FIFO;
+		else if (strcmp(argv[2], "phasefair") == 0)
+			policy = OSPRD_POLICY_PHASEFAIR;
+		else
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a lock class option
+	if (argc >= 2 && strcmp(argv[1], "-p") == 0) {
+		if (argc < 3)
+			usage(1);
+		else if (strcmp(argv[2], "low") == 0)
+			lock_class = OSPRD_CLASS_LOW;
+		else if (strcmp(argv[2], "normal") == 0)
+			lock_class = OSPRD_CLASS_NORMAL;
+		else if (strcmp(argv[2], "high") == 0)
+			lock_class = OSPRD_CLASS_HIGH;
+		else
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect an asynchronous lock option
+	if (argc >= 2 && strcmp(argv[1], "-a") == 0) {
+		doasync = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a fast-path lock option
+	if (argc >= 2 && strcmp(argv[1], "-f") == 0) {
+		dofast = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a write-back option
+	if (argc >= 2 && strcmp(argv[1], "-W") == 0) {
+		dowriteback = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a direct I/O option
+	if (argc >= 2 && strcmp(argv[1], "-D") == 0) {
+		dodirect = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a CPU option
+	if (argc >= 2 && strcmp(argv[1], "-C") == 0) {
+		ssize_t cpu;
+		cpu_set_t set;
+		if (argc < 3 || !parse_ssize(argv[2], &cpu) || cpu < 0
+		    || cpu >= CPU_SETSIZE)
+			usage(1);
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+			perror("sched_setaffinity");
+			exit(1);
+		}
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a latency option
+	if (argc >= 2 && strcmp(argv[1], "-R") == 0) {
+		dolatency = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect an I/O unit option
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+		if (argc < 3 || !parse_ssize(argv[2], &io_unit)
+		    || io_unit <= 0 || io_unit > MAXIOUNIT)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
 	// Detect a delay option
 	if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
 		argv++, argc--;
@@ -218,6 +1043,20 @@ int main(int argc, char *argv[])
 	if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
 		usage(0);
 
+	// Run a script instead of a single transfer
+	if (script) {
+		scriptf = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+		if (!scriptf) {
+			perror(script);
+			exit(1);
+		}
+		exit(run_script(scriptf, dotiming));
+	}
+
+	// Probe the cache instead of transferring
+	if (probe_size)
+		exit(cache_probe(probe_size, probe_secs));
+
 	// Detect a device name
 	if (argc >= 2 && argv[1][1] != '-') {
 		devname = argv[1];
@@ -225,12 +1064,19 @@ int main(int argc, char *argv[])
 	}
 
 	// Open ramdisk file
-	devfd = open(devname, mode);
+	devfd = open(devname, (dofast ? O_RDWR : mode)
+		     | (dodirect ? O_DIRECT : 0));
 	if (devfd == -1) {
 		perror("open");
 		exit(1);
 	}
 
+	// Let the page cache batch writes
+	if (dowriteback && ioctl(devfd, OSPRDIOCSYNC, 0) == -1) {
+		perror("ioctl OSPRDIOCSYNC");
+		exit(1);
+	}
+
 	// Request change notification
 	if (notif) {
 		if (ioctl(devfd, OSPRDIOCNOTIFY, sector) == -1) {
@@ -239,11 +1085,52 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// Set lock policy
+	if (policy >= 0) {
+		if (ioctl(devfd, OSPRDIOCSETPOLICY, policy) == -1) {
+			perror("ioctl OSPRDIOCSETPOLICY");
+			exit(1);
+		}
+		policy = -1;
+	}
+
+	// Take a snapshot, possibly after delay
+	if (dosnapshot) {
+		if (lock_delay >= 0)
+			sleep_for(lock_delay);
+		if (ioctl(devfd, OSPRDIOCSNAPSHOT, NULL) == -1) {
+			perror("ioctl OSPRDIOCSNAPSHOT");
+			exit(1);
+		}
+		dosnapshot = 0;
+	}
+
 	// Lock, possibly after delay
 	if (dolock || dotrylock) {
 		if (lock_delay >= 0)
 			sleep_for(lock_delay);
-		if (dolock
+		if (dofast) {
+			if (fast_lock(devfd, (mode & O_WRONLY) != 0,
+				      dotrylock) == -1) {
+				perror("fast lock");
+				exit(1);
+			}
+		} else if (dolock && doasync) {
+			if (async_lock(devfd) == -1) {
+				perror("ioctl OSPRDIOCENQUEUE");
+				exit(1);
+			}
+		} else if (dolock && lock_timeout >= 0
+		    && ioctl(devfd, OSPRDIOCTIMEDACQUIRE,
+			     (unsigned long) (lock_timeout * 1000)) == -1) {
+			perror("ioctl OSPRDIOCTIMEDACQUIRE");
+			exit(1);
+		} else if (dolock && lock_timeout < 0 && lock_class >= 0
+		    && ioctl(devfd, OSPRDIOCCLASSACQUIRE,
+			     (unsigned long) lock_class) == -1) {
+			perror("ioctl OSPRDIOCCLASSACQUIRE");
+			exit(1);
+		} else if (dolock && lock_timeout < 0 && lock_class < 0
 		    && ioctl(devfd, OSPRDIOCACQUIRE, NULL) == -1) {
 			perror("ioctl OSPRDIOCACQUIRE");
 			exit(1);
@@ -262,6 +1149,54 @@ int main(int argc, char *argv[])
 	if (argc > 1)
 		goto flag;
 
+	// Report changed sectors instead of reading or writing
+	if (dochanges) {
+		print_changes(devfd, since);
+		exit(0);
+	}
+
+	// Configure or report mirroring instead of reading or writing
+	if (domirror) {
+		if (ioctl(devfd, OSPRDIOCMIRROR, (unsigned long) mirror) == -1) {
+			perror("ioctl OSPRDIOCMIRROR");
+			exit(1);
+		}
+		exit(0);
+	}
+	if (dostat) {
+		print_status(devfd);
+		exit(0);
+	}
+
+	// Scrub instead of reading or writing
+	if (doscrub) {
+		gettimeofday(&start, 0);
+		if (ioctl(devfd, OSPRDIOCSCRUB, &scrub) == -1) {
+			perror("ioctl OSPRDIOCSCRUB");
+			exit(1);
+		}
+		gettimeofday(&end, 0);
+		printf("checked: %llu\nbad: %u\n", scrub.checked, scrub.nbad);
+		for (i = 0; i < (int) scrub.nbad && i < OSPRD_SCRUB_MAXBAD; i++)
+			printf("%u\n", scrub.bad[i]);
+		if (dotiming) {
+			timersub(&end, &start, &end);
+			secs = end.tv_sec + end.tv_usec / 1000000.0;
+			fprintf(stderr, "scrubbed %llu sectors in %.6f s\n",
+				scrub.checked, secs);
+		}
+		exit(scrub.nbad != 0);
+	}
+
+	// Set throttling limits instead of reading or writing
+	if (dothrottle) {
+		if (ioctl(devfd, OSPRDIOCTHROTTLE, &throttle) == -1) {
+			perror("ioctl OSPRDIOCTHROTTLE");
+			exit(1);
+		}
+		exit(0);
+	}
+
 	// Seek to offset
 	if (lseek(devfd, offset, SEEK_SET) == (off_t) -1) {
 		perror("lseek");
@@ -272,12 +1207,35 @@ int main(int argc, char *argv[])
 	}
 
 	// Read or write
+	if (dolatency)
+		latency_fd = devfd;
+	gettimeofday(&start, 0);
 	if ((mode & O_WRONLY) && zero)
-		transfer_zero(devfd, size);
+		moved = transfer_zero(devfd, size);
+	else if ((mode & O_WRONLY) && dozerocopy)
+		moved = transfer_zerocopy(STDIN_FILENO, devfd, size, &method);
 	else if (mode & O_WRONLY)
-		transfer(STDIN_FILENO, devfd, size);
+		moved = transfer(STDIN_FILENO, devfd, size);
+	else if (dozerocopy)
+		moved = transfer_zerocopy(devfd, STDOUT_FILENO, size, &method);
 	else
-		transfer(devfd, STDOUT_FILENO, size);
+		moved = transfer(devfd, STDOUT_FILENO, size);
+	if ((mode & O_WRONLY) && dowriteback && fsync(devfd) == -1) {
+		perror("fsync");
+		exit(1);
+	}
+	gettimeofday(&end, 0);
+
+	// Report throughput
+	if (dotiming) {
+		timersub(&end, &start, &end);
+		secs = end.tv_sec + end.tv_usec / 1000000.0;
+		fprintf(stderr, "%s: %ld bytes in %.6f s (%.1f MB/s)\n",
+			zc_names[method], (long) moved, secs,
+			secs > 0 ? moved / secs / 1048576 : 0.0);
+	}
+	if (dolatency)
+		print_latencies();
 
 	exit(0);
 }
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE		/* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "osprd.h"
+
+#define NDEVS		4
+#define MAXREQUEST	(2048 * 512)	// Largest request the driver takes
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Replays a trace of OSP ramdisk requests and ioctls.\n\
+Usage: ./osprdreplay [-f] [-T] TRACE\n\
+   To record a trace:\n\
+       echo 1 > /sys/module/osprd/parameters/trace\n\
+       (run the workload)\n\
+       echo 0 > /sys/module/osprd/parameters/trace\n\
+       cat /proc/osprdtrace > TRACE\n\
+   Each process in the trace is replayed by a process of its own, with the\n\
+   original timing.  Requests are reissued with O_DIRECT at their original\n\
+   sectors and sizes (written data is zeros).  Lock, notification and\n\
+   policy ioctls are reissued on a file per device and open mode, which is\n\
+   closed where the original was; other ioctls are skipped.\n\
+   Options are:\n\
+   -f\n\
+       Replay as fast as possible instead of with the original timing.\n\
+   -T\n\
+       Report the number of events replayed and the time taken on stderr.\n");
+	exit(status);
+}
+
+// An event and its position in the trace, so sorting by time keeps the
+// order of simultaneous events.
+struct trace_entry {
+	struct osprd_trace_event e;
+	size_t index;
+};
+
+int compare_entries(const void *a, const void *b)
+{
+	const struct trace_entry *x = a, *y = b;
+	if (x->e.usecs != y->e.usecs)
+		return x->e.usecs < y->e.usecs ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Read the trace in 'fname' into an array sorted by time; set *n to its
+// length.
+struct trace_entry *read_trace(const char *fname, size_t *n)
+{
+	struct trace_entry *t = NULL;
+	struct osprd_trace_event e;
+	size_t cap = 0;
+	FILE *f = fopen(fname, "r");
+	if (!f) {
+		perror(fname);
+		exit(1);
+	}
+
+	*n = 0;
+	while (fread(&e, sizeof(e), 1, f) == 1) {
+		if (*n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			t = realloc(t, cap * sizeof(*t));
+			if (!t) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		t[*n].e = e;
+		t[*n].index = *n;
+		(*n)++;
+	}
+	fclose(f);
+
+	qsort(t, *n, sizeof(*t), compare_entries);
+	return t;
+}
+
+// Wait until 'usecs' microseconds after 'start'.
+void wait_until(const struct timeval *start, unsigned long long usecs)
+{
+	struct timeval now, delta, end;
+	delta.tv_sec = usecs / 1000000;
+	delta.tv_usec = usecs % 1000000;
+	timeradd(start, &delta, &end);
+
+	while (1) {
+		gettimeofday(&now, 0);
+		if (!timercmp(&end, &now, >))
+			break;
+		timersub(&end, &now, &delta);
+		(void) select(0, 0, 0, 0, &delta);
+	}
+}
+
+// Returns 1 if ioctl 'cmd' takes a plain integer argument and can be
+// replayed as recorded.
+int replayable(unsigned cmd)
+{
+	switch (cmd) {
+	case OSPRDIOCACQUIRE:
+	case OSPRDIOCTRYACQUIRE:
+	case OSPRDIOCRELEASE:
+	case OSPRDIOCNOTIFY:
+	case OSPRDIOCSECTOR:
+	case OSPRDIOCSETPOLICY:
+	case OSPRDIOCTIMEDACQUIRE:
+	case OSPRDIOCUPGRADE:
+	case OSPRDIOCDOWNGRADE:
+	case OSPRDIOCENQUEUE:
+	case OSPRDIOCCANCEL:
+	case OSPRDIOCCLASSACQUIRE:
+	case OSPRDIOCSNAPSHOT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+char *device_name(int dev)
+{
+	static char name[] = "/dev/osprda";
+	name[strlen(name) - 1] = 'a' + dev;
+	return name;
+}
+
+// Replay the events of process 'pid' in t[0..n).
+void replay_process(struct trace_entry *t, size_t n, unsigned pid,
+		    const struct timeval *start, int fast)
+{
+	int iofds[NDEVS], lockfds[NDEVS][2];
+	unsigned long long base = t[0].e.usecs;
+	struct osprd_trace_event *e;
+	size_t i;
+	ssize_t len;
+	char *buf;
+	int fd;
+
+	if (posix_memalign((void **) &buf, 4096, MAXREQUEST) != 0) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(buf, 0, MAXREQUEST);
+	for (i = 0; i < NDEVS; i++)
+		iofds[i] = lockfds[i][0] = lockfds[i][1] = -1;
+
+	for (i = 0; i < n; i++) {
+		e = &t[i].e;
+		if (e->pid != pid || e->dev >= NDEVS
+		    || e->type == OSPRD_TRACE_LOST)
+			continue;
+		if (e->type == OSPRD_TRACE_IOCTL && !replayable(e->cmd))
+			continue;
+		if (!fast)
+			wait_until(start, e->usecs - base);
+
+		if (e->type == OSPRD_TRACE_REQUEST) {
+			fd = iofds[e->dev];
+			if (fd == -1) {
+				fd = open(device_name(e->dev),
+					  O_RDWR | O_DIRECT);
+				if (fd == -1)
+					fd = open(device_name(e->dev), O_RDWR);
+				if (fd == -1) {
+					perror(device_name(e->dev));
+					exit(1);
+				}
+				iofds[e->dev] = fd;
+			}
+			len = (ssize_t) e->arg * 512;
+			if (len > MAXREQUEST)
+				len = MAXREQUEST;
+			if (e->write)
+				len = pwrite(fd, buf, len,
+					     (off_t) e->sector * 512);
+			else
+				len = pread(fd, buf, len,
+					    (off_t) e->sector * 512);
+			if (len == -1)
+				perror(e->write ? "pwrite" : "pread");
+		} else if (e->type == OSPRD_TRACE_IOCTL) {
+			fd = lockfds[e->dev][e->write != 0];
+			if (fd == -1) {
+				fd = open(device_name(e->dev),
+					  e->write ? O_RDWR : O_RDONLY);
+				if (fd == -1) {
+					perror(device_name(e->dev));
+					exit(1);
+				}
+				lockfds[e->dev][e->write != 0] = fd;
+			}
+			// Failures such as EBUSY are part of the workload.
+			(void) ioctl(fd, e->cmd, (unsigned long) e->arg);
+		} else if (e->type == OSPRD_TRACE_CLOSE) {
+			fd = lockfds[e->dev][e->write != 0];
+			if (fd != -1)
+				close(fd);
+			lockfds[e->dev][e->write != 0] = -1;
+		}
+	}
+
+	free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace_entry *t;
+	struct timeval start, end;
+	size_t n, i, j, nevents = 0, lost = 0;
+	unsigned *pids;
+	size_t npids = 0;
+	int fast = 0, dotiming = 0, status, failed = 0;
+	pid_t child;
+
+ flag:
+	// Detect a fast replay option
+	if (argc >= 2 && strcmp(argv[1], "-f") == 0) {
+		fast = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a timing option
+	if (argc >= 2 && strcmp(argv[1], "-T") == 0) {
+		dotiming = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	if (argc >= 2 && (strcmp(argv[1], "-h") == 0
+			  || strcmp(argv[1], "--help") == 0))
+		usage(0);
+	if (argc != 2)
+		usage(1);
+
+	t = read_trace(argv[1], &n);
+	if (n == 0)
+		exit(0);
+
+	// Find the processes in the trace
+	pids = malloc(n * sizeof(*pids));
+	if (!pids) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		if (t[i].e.type == OSPRD_TRACE_LOST) {
+			lost += t[i].e.arg;
+			continue;
+		}
+		nevents++;
+		for (j = 0; j < npids && pids[j] != t[i].e.pid; j++)
+			/* do nothing */;
+		if (j == npids)
+			pids[npids++] = t[i].e.pid;
+	}
+	if (lost)
+		fprintf(stderr, "warning: %lu events were lost while "
+			"recording\n", (unsigned long) lost);
+
+	// Replay each process in a child of its own, so one waiting for a
+	// lock doesn't hold up the others
+	gettimeofday(&start, 0);
+	for (j = 0; j < npids; j++) {
+		child = fork();
+		if (child == -1) {
+			perror("fork");
+			exit(1);
+		} else if (child == 0) {
+			replay_process(t, n, pids[j], &start, fast);
+			exit(0);
+		}
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	gettimeofday(&end, 0);
+
+	if (dotiming) {
+		timersub(&end, &start, &end);
+		fprintf(stderr, "%lu events from %lu processes in %.6f s\n",
+			(unsigned long) nevents, (unsigned long) npids,
+			end.tv_sec + end.tv_usec / 1000000.0);
+	}
+	exit(failed);
+}